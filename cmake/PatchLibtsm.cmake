@@ -0,0 +1,26 @@
+# uterm carries a few patches on top of libtsm (see patches/libtsm), which are applied to
+# the submodule in place. A patch that can already be reversed is taken to be applied.
+find_package(Git REQUIRED)
+
+set(LIBTSM_DIR ${CMAKE_CURRENT_SOURCE_DIR}/deps/libtsm)
+file(GLOB LIBTSM_PATCHES ${CMAKE_CURRENT_SOURCE_DIR}/patches/libtsm/*.patch)
+list(SORT LIBTSM_PATCHES)
+
+foreach (patch ${LIBTSM_PATCHES})
+  execute_process(
+    COMMAND ${GIT_EXECUTABLE} apply -C1 --reverse --check ${patch}
+    WORKING_DIRECTORY ${LIBTSM_DIR}
+    RESULT_VARIABLE not_applied
+    OUTPUT_QUIET ERROR_QUIET)
+
+  if (not_applied)
+    message(STATUS "Applying ${patch}")
+    execute_process(
+      COMMAND ${GIT_EXECUTABLE} apply -C1 ${patch}
+      WORKING_DIRECTORY ${LIBTSM_DIR}
+      RESULT_VARIABLE failed)
+    if (failed)
+      message(FATAL_ERROR "Failed to apply ${patch} to deps/libtsm")
+    endif ()
+  endif ()
+endforeach ()
@@ -0,0 +1,266 @@
+#include "atlas_renderer.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+constexpr uint32 AtlasRenderer::kNoGlyph;
+
+// Both passes draw a quad per cell as a 4-vertex triangle strip, with the corner taken
+// from gl_VertexID. Backgrounds cover their cell exactly, while glyphs cover their whole
+// slot, starting from the top left of their cell.
+static const char vertex_source[] =
+  "#version 330 core\n"
+
+  "layout (location = 0) in uvec4 in_cell;"
+
+  "uniform vec2 viewport;"
+  "uniform int cols;"
+  "uniform vec2 cell_size;"
+  "uniform float top;"
+  "uniform bool glyph_pass;"
+  "uniform uint atlas_cols;"
+  "uniform vec2 slot_size;"
+  "uniform float atlas_size;"
+
+  "flat out uvec4 cell;"
+  "out vec2 local;"
+  "out vec2 texpos;"
+
+  "void main() {"
+    "int col = gl_InstanceID % cols, row = gl_InstanceID / cols;"
+    "vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);"
+
+    "float left = floor(col * cell_size.x + 0.5);"
+    "float right = floor((col + 1) * cell_size.x + 0.5);"
+    "vec2 size = glyph_pass ? slot_size : vec2(right - left, cell_size.y);"
+    "if (glyph_pass && in_cell.x == 0xffffffffu) {"
+      "size = vec2(0.0);"
+    "}"
+
+    "vec2 pos = vec2(left, top + row * cell_size.y) + corner * size;"
+    "gl_Position = vec4(pos.x / viewport.x * 2.0 - 1.0, 1.0 - pos.y / viewport.y * 2.0,"
+                       "0.0, 1.0);"
+
+    "vec2 slot = vec2(in_cell.x % atlas_cols, in_cell.x / atlas_cols);"
+    "texpos = (slot + corner) * slot_size / atlas_size;"
+    "local = corner * size;"
+    "cell = in_cell;"
+  "}"
+;
+
+static const char fragment_source[] =
+  "#version 330 core\n"
+
+  "uniform sampler2D atlas;"
+  "uniform bool glyph_pass;"
+  "uniform vec2 underline;"
+
+  "flat in uvec4 cell;"
+  "in vec2 local;"
+  "in vec2 texpos;"
+
+  "out vec4 out_color;"
+
+  // Colors come in as SkColors, i.e. ARGB.
+  "vec4 unpack(uint color) {"
+    "return vec4((color >> 16) & 0xffu, (color >> 8) & 0xffu, color & 0xffu,"
+                "color >> 24) / 255.0;"
+  "}"
+
+  "void main() {"
+    "if (glyph_pass) {"
+      "out_color = vec4(unpack(cell.y).rgb, texture(atlas, texpos).r);"
+    "} else if ((cell.w & 1u) != 0u && local.y >= underline.x &&"
+               "local.y < underline.x + underline.y) {"
+      "out_color = unpack(cell.y);"
+    "} else {"
+      "out_color = unpack(cell.z);"
+    "}"
+  "}"
+;
+
+Error AtlasRenderer::Initialize() {
+  *m_vertex.id_ptr() = glCreateShader(GL_VERTEX_SHADER);
+  if (auto err = CompileShader(m_vertex.id(), vertex_source)) {
+    return err.Extend("while compiling atlas vertex shader");
+  }
+
+  *m_fragment.id_ptr() = glCreateShader(GL_FRAGMENT_SHADER);
+  if (auto err = CompileShader(m_fragment.id(), fragment_source)) {
+    return err.Extend("while compiling atlas fragment shader");
+  }
+
+  *m_program.id_ptr() = glCreateProgram();
+  if (auto err = LinkProgram(m_program.id(), m_vertex.id(), m_fragment.id())) {
+    return err;
+  }
+
+  glGenVertexArrays(1, m_vao.id_ptr());
+  glGenBuffers(1, m_instances.id_ptr());
+
+  glBindVertexArray(m_vao.id());
+  glBindBuffer(GL_ARRAY_BUFFER, m_instances.id());
+  glVertexAttribIPointer(0, 4, GL_UNSIGNED_INT, sizeof(Cell), reinterpret_cast<void*>(0));
+  glVertexAttribDivisor(0, 1);
+  glEnableVertexAttribArray(0);
+
+  glGenTextures(1, m_atlas.id_ptr());
+  glBindTexture(GL_TEXTURE_2D, m_atlas.id());
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, kAtlasSize, kAtlasSize, 0, GL_RED,
+               GL_UNSIGNED_BYTE, nullptr);
+
+  glUseProgram(m_program.id());
+  glUniform1i(glGetUniformLocation(m_program.id(), "atlas"), 0);
+  glUniform1f(glGetUniformLocation(m_program.id(), "atlas_size"), kAtlasSize);
+
+  return Error::New();
+}
+
+void AtlasRenderer::Resize(int width, int height) {
+  m_width = width;
+  m_height = height;
+}
+
+bool AtlasRenderer::SetGrid(const Grid &grid) {
+  if (grid == m_grid) {
+    return false;
+  }
+
+  int slot_width = 2 * std::ceil(grid.cell_width), slot_height = grid.cell_height;
+  if (slot_width != m_slot_width || slot_height != m_slot_height ||
+      grid.baseline != m_grid.baseline) {
+    m_slot_width = std::max(slot_width, 1);
+    m_slot_height = std::max(slot_height, 1);
+    m_atlas_cols = kAtlasSize / m_slot_width;
+    m_slot_count = m_atlas_cols * (kAtlasSize / m_slot_height);
+    m_mask.resize(m_slot_width * m_slot_height);
+    ResetAtlas();
+  }
+
+  m_grid = grid;
+  m_cells.assign(grid.cols * grid.rows, Cell{});
+  m_reallocate = true;
+  return true;
+}
+
+void AtlasRenderer::ResetAtlas() {
+  m_slots.clear();
+  m_next_slot = 0;
+  m_generation++;
+}
+
+uint32 AtlasRenderer::FindSlot(uint64 key, const RasterizeCb &rasterize) {
+  auto it = m_slots.find(key);
+  if (it != m_slots.end()) {
+    return it->second;
+  }
+
+  if (m_next_slot == m_slot_count) {
+    // Rather than keep track of which glyphs are still in use, just start over. The
+    // caller will notice the generation changed and set every cell again.
+    ResetAtlas();
+  }
+
+  TraceScope trace{"AtlasRenderer::Rasterize"};
+
+  uint32 slot = m_next_slot++;
+  std::fill(m_mask.begin(), m_mask.end(), 0);
+  rasterize(m_mask.data(), m_slot_width, m_slot_width, m_slot_height);
+
+  glBindTexture(GL_TEXTURE_2D, m_atlas.id());
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, slot % m_atlas_cols * m_slot_width,
+                  slot / m_atlas_cols * m_slot_height, m_slot_width, m_slot_height,
+                  GL_RED, GL_UNSIGNED_BYTE, m_mask.data());
+
+  m_slots.emplace(key, slot);
+  return slot;
+}
+
+void AtlasRenderer::MarkChanged(size_t begin, size_t end) {
+  if (m_changed_begin == m_changed_end) {
+    m_changed_begin = begin;
+    m_changed_end = end;
+  } else {
+    m_changed_begin = std::min(m_changed_begin, begin);
+    m_changed_end = std::max(m_changed_end, end);
+  }
+}
+
+void AtlasRenderer::SetCell(size_t index, const Cell &cell) {
+  if (index >= m_cells.size()) {
+    return;
+  }
+
+  m_cells[index] = cell;
+  MarkChanged(index, index + 1);
+}
+
+void AtlasRenderer::MoveCells(size_t dest, size_t src, size_t count) {
+  if (std::max(dest, src) + count > m_cells.size()) {
+    return;
+  }
+
+  memmove(&m_cells[dest], &m_cells[src], count * sizeof(Cell));
+  MarkChanged(std::min(dest, src), std::max(dest, src) + count);
+}
+
+void AtlasRenderer::Draw(SkColor background) {
+  TraceScope trace{"AtlasRenderer::Draw"};
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_instances.id());
+  if (m_reallocate) {
+    glBufferData(GL_ARRAY_BUFFER, m_cells.size() * sizeof(Cell), m_cells.data(),
+                 GL_DYNAMIC_DRAW);
+    m_reallocate = false;
+  } else if (m_changed_begin != m_changed_end) {
+    glBufferSubData(GL_ARRAY_BUFFER, m_changed_begin * sizeof(Cell),
+                    (m_changed_end - m_changed_begin) * sizeof(Cell),
+                    &m_cells[m_changed_begin]);
+  }
+  m_changed_begin = m_changed_end = 0;
+
+  glViewport(0, 0, m_width, m_height);
+  glClearColor(SkColorGetR(background) / 255.0, SkColorGetG(background) / 255.0,
+               SkColorGetB(background) / 255.0, SkColorGetA(background) / 255.0);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  if (m_cells.empty()) {
+    return;
+  }
+
+  GLuint program = m_program.id();
+  glUseProgram(program);
+  glBindVertexArray(m_vao.id());
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, m_atlas.id());
+
+  glUniform2f(glGetUniformLocation(program, "viewport"), m_width, m_height);
+  glUniform1i(glGetUniformLocation(program, "cols"), m_grid.cols);
+  glUniform2f(glGetUniformLocation(program, "cell_size"), m_grid.cell_width,
+              m_grid.cell_height);
+  glUniform1f(glGetUniformLocation(program, "top"), m_grid.top);
+  glUniform1ui(glGetUniformLocation(program, "atlas_cols"), m_atlas_cols);
+  glUniform2f(glGetUniformLocation(program, "slot_size"), m_slot_width, m_slot_height);
+  glUniform2f(glGetUniformLocation(program, "underline"), m_grid.underline_y,
+              m_grid.underline_height);
+
+  GLint glyph_pass = glGetUniformLocation(program, "glyph_pass");
+  GLsizei instances = m_cells.size();
+
+  glUniform1i(glyph_pass, 0);
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, instances);
+
+  // Glyphs are blended on top by their coverage, leaving the backgrounds' alpha alone.
+  glEnable(GL_BLEND);
+  glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
+  glUniform1i(glyph_pass, 1);
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, instances);
+  glDisable(GL_BLEND);
+}
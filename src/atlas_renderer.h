@@ -0,0 +1,103 @@
+#pragma once
+
+#include "base.h"
+#include "error.h"
+#include "gl_manager.h"
+
+#include <SkColor.h>
+
+#include <functional>
+#include <vector>
+
+#define PHMAP_USE_ABSL_HASHEQ
+#include <parallel_hashmap/phmap.h>
+
+// An AtlasRenderer draws the terminal's grid straight to the framebuffer with OpenGL,
+// instead of rendering it with Skia first. Each glyph is rasterized once into a slot of a
+// texture atlas, and each cell is an instance holding its glyph's slot and colors, so the
+// whole grid takes two instanced draws: one for the backgrounds, and one for the glyphs
+// on top. Only the instances of cells that changed are uploaded each frame.
+class AtlasRenderer {
+public:
+  // The slot of cells that have no glyph to draw.
+  static constexpr uint32 kNoGlyph = std::numeric_limits<uint32>::max();
+  static constexpr uint32 kUnderline = 1 << 0;
+
+  struct Cell {
+    uint32 slot{kNoGlyph};
+    SkColor foreground{0}, background{0};
+    uint32 flags{0};
+  };
+
+  // The layout of the grid, in pixels. Columns may be a fractional number of pixels
+  // wide, but rows are always whole ones.
+  struct Grid {
+    int cols{0}, rows{0};
+    float cell_width{0};
+    int cell_height{0};
+    // Where the first row starts, and where the baseline and underline are in each one.
+    int top{0};
+    float baseline{0}, underline_y{0}, underline_height{0};
+
+    bool operator==(const Grid &rhs) const {
+      return cols == rhs.cols && rows == rhs.rows && cell_width == rhs.cell_width &&
+             cell_height == rhs.cell_height && top == rhs.top &&
+             baseline == rhs.baseline && underline_y == rhs.underline_y &&
+             underline_height == rhs.underline_height;
+    }
+  };
+
+  Error Initialize();
+  void Resize(int width, int height);
+
+  const Grid & grid() const { return m_grid; }
+  // Changes the layout of the grid. Returns true if every cell was reset, and so they
+  // all need to be set again.
+  bool SetGrid(const Grid &grid);
+
+  // Called to draw a glyph (with its baseline at the grid's baseline) into a coverage
+  // mask of the given size, which starts out blank.
+  using RasterizeCb = std::function<void(uint8_t *pixels, size_t row_bytes, int width,
+                                         int height)>;
+  // Returns the slot of the glyph with the given key, rasterizing it first if it isn't
+  // in the atlas yet.
+  uint32 FindSlot(uint64 key, const RasterizeCb &rasterize);
+  // Incremented every time the atlas fills up and is emptied out, after which any slots
+  // returned by FindSlot before then are no longer valid.
+  uint64 generation() const { return m_generation; }
+
+  void SetCell(size_t index, const Cell &cell);
+  // Moves count cells from src to dest, which may overlap.
+  void MoveCells(size_t dest, size_t src, size_t count);
+
+  void Draw(SkColor background);
+private:
+  // The atlas is a square texture this many pixels across.
+  static constexpr int kAtlasSize = 2048;
+
+  void ResetAtlas();
+  void MarkChanged(size_t begin, size_t end);
+
+  int m_width{-1}, m_height{-1};
+  Grid m_grid;
+
+  GLManager::IdWrapper<GLManager::ShaderId> m_vertex, m_fragment;
+  GLManager::IdWrapper<GLManager::ProgramId> m_program;
+  GLManager::IdWrapper<GLManager::VertexArrayId> m_vao;
+  GLManager::IdWrapper<GLManager::BufferId> m_instances;
+  GLManager::IdWrapper<GLManager::TextureId> m_atlas;
+
+  // Each slot is two cells wide, so wide characters and anything hanging over the edge of
+  // a cell still fit.
+  int m_slot_width{0}, m_slot_height{0}, m_atlas_cols{0};
+  uint32 m_slot_count{0}, m_next_slot{0};
+  uint64 m_generation{0};
+  phmap::flat_hash_map<uint64, uint32> m_slots;
+  std::vector<uint8_t> m_mask;
+
+  std::vector<Cell> m_cells;
+  // The range of cells that changed since they were last uploaded.
+  size_t m_changed_begin{0}, m_changed_end{0};
+  // Set when the instance buffer needs to be reallocated to fit the grid.
+  bool m_reallocate{true};
+};
@@ -0,0 +1,451 @@
+// uterm-bench feeds canned output through the same Terminal and Display that uterm
+// uses, but draws to an offscreen raster surface instead of a window, and reports how
+// fast it all went.
+
+#include "config.h"
+#include "display.h"
+#include "recorder.h"
+#include "trace.h"
+#include "terminal.h"
+
+#include <SkSurface.h>
+
+#include <absl/strings/numbers.h>
+#include <utf8.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <random>
+#include <thread>
+#include <vector>
+
+using clock_type = std::chrono::steady_clock;
+
+struct Options {
+  int width{1280}, height{800};
+  string font{"monospace"};
+  int font_size{16};
+  // How much output each workload feeds through in total, and how much of it is parsed
+  // between frames (like a single read from the pty).
+  uint64 total_size{32 << 20};
+  size_t chunk_size{64 * 1024};
+  // Lines that scroll off are kept, like they would be in uterm.
+  size_t scrollback_lines{10000};
+  std::vector<string> workloads;
+  // A recording to replay instead of the workloads, and whether to keep its timing.
+  string replay_path;
+  bool realtime{false};
+  string trace_path;
+};
+
+// Each workload's output is generated once, up to this size, and then fed through over
+// and over again.
+constexpr size_t kCorpusSize = 4 << 20;
+constexpr int kLineWidth = 100;
+
+static char RandomPrintable(std::mt19937 *rng) {
+  return ' ' + (*rng)() % ('~' - ' ' + 1);
+}
+
+static string GenerateAscii(std::mt19937 *rng) {
+  string out;
+  while (out.size() < kCorpusSize) {
+    int length = (*rng)() % kLineWidth;
+    for (int i = 0; i < length; i++) {
+      out.push_back(RandomPrintable(rng));
+    }
+    out += "\r\n";
+  }
+  return out;
+}
+
+static string GenerateSgr(std::mt19937 *rng) {
+  // Like the output of ls --color or a syntax highlighter: short runs of text, each with
+  // its own colors and flags.
+  constexpr int kFlags[] = {0, 1, 4, 7};
+
+  string out;
+  while (out.size() < kCorpusSize) {
+    for (int column = 0; column < kLineWidth; ) {
+      int length = 1 + (*rng)() % 10;
+      out += fmt::format("\x1b[{};3{};4{}m", kFlags[(*rng)() % 4], (*rng)() % 8,
+                         (*rng)() % 8);
+      for (int i = 0; i < length; i++) {
+        out.push_back(RandomPrintable(rng));
+      }
+      column += length;
+    }
+    out += "\x1b[0m\r\n";
+  }
+  return out;
+}
+
+static string GenerateTruecolor(std::mt19937 *rng) {
+  // Every character gets its own 24-bit foreground and background, like a gradient.
+  string out;
+  while (out.size() < kCorpusSize) {
+    for (int i = 0; i < kLineWidth; i++) {
+      uint color = (*rng)();
+      out += fmt::format("\x1b[38;2;{};{};{};48;2;{};{};{}m", color & 0xff,
+                         (color >> 8) & 0xff, (color >> 16) & 0xff, (color >> 24) & 0xff,
+                         (color >> 4) & 0xff, (color >> 12) & 0xff);
+      out.push_back(RandomPrintable(rng));
+    }
+    out += "\x1b[0m\r\n";
+  }
+  return out;
+}
+
+static string GenerateCjk(std::mt19937 *rng) {
+  // Double-width characters from the CJK Unified Ideographs block.
+  constexpr uint32 kFirst = 0x4e00, kCount = 0x5000;
+
+  string out;
+  while (out.size() < kCorpusSize) {
+    for (int i = 0; i < kLineWidth / 2; i++) {
+      utf8::append(kFirst + (*rng)() % kCount, std::back_inserter(out));
+    }
+    out += "\r\n";
+  }
+  return out;
+}
+
+static string GenerateScroll(std::mt19937 *rng) {
+  // Like paging through a file: scroll the whole screen by a line, either way, and fill
+  // in the line that was uncovered.
+  string out;
+  while (out.size() < kCorpusSize) {
+    bool up = (*rng)() % 2;
+    int lines = 1 + (*rng)() % 30;
+    for (int i = 0; i < lines; i++) {
+      // Reverse index at the top scrolls down; a newline at the bottom scrolls up.
+      out += up ? "\x1b[H\x1bM" : "\x1b[999;1H\n\r";
+      for (int j = 0; j < kLineWidth; j++) {
+        out.push_back(RandomPrintable(rng));
+      }
+    }
+  }
+  return out;
+}
+
+static string GenerateRedraw(std::mt19937 *rng) {
+  // Like a full-screen program repainting everything at once: home the cursor, then
+  // write every row from scratch in short runs of different colors. Every cell changes
+  // each time, so this is mostly a measure of the cost of drawing.
+  constexpr int kRows = 80;
+
+  string out;
+  while (out.size() < kCorpusSize) {
+    out += "\x1b[H";
+    for (int row = 0; row < kRows; row++) {
+      for (int column = 0; column < kLineWidth; ) {
+        int length = 1 + (*rng)() % 16;
+        out += fmt::format("\x1b[3{};4{}m", (*rng)() % 8, (*rng)() % 8);
+        for (int i = 0; i < length; i++) {
+          out.push_back(RandomPrintable(rng));
+        }
+        column += length;
+      }
+      out += "\x1b[0m\x1b[K\r\n";
+    }
+  }
+  return out;
+}
+
+struct Workload {
+  const char *name;
+  string (*generate)(std::mt19937 *rng);
+};
+
+constexpr Workload kWorkloads[] = {
+  {"ascii", GenerateAscii},
+  {"sgr", GenerateSgr},
+  {"truecolor", GenerateTruecolor},
+  {"cjk", GenerateCjk},
+  {"scroll", GenerateScroll},
+  {"redraw", GenerateRedraw},
+};
+
+static double Seconds(clock_type::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+static double Percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(sorted.size() - 1, static_cast<size_t>(sorted.size() * p))];
+}
+
+// A Harness owns a terminal and an offscreen display, and times everything fed through
+// them.
+class Harness {
+public:
+  Harness(const Options &opts): m_opts{opts}, m_display{&m_term} {}
+
+  Error Initialize();
+  // Resizes the display (in pixels).
+  Error Resize(int width, int height);
+  // Resizes the display to fit the given columns and rows.
+  Error ResizeToCells(int cols, int rows);
+
+  // Parses the given output and then draws a frame.
+  void Feed(absl::string_view output);
+  void Report(absl::string_view name);
+private:
+  const Options &m_opts;
+  Terminal m_term;
+  Display m_display;
+  sk_sp<SkSurface> m_surface;
+
+  uint64 m_bytes{0}, m_cells{0};
+  clock_type::duration m_parsing{0};
+  std::vector<double> m_frame_times;
+};
+
+Error Harness::Initialize() {
+  m_term.set_theme(kDefaultTheme);
+  m_term.set_title_cb([](const string &title) {});
+  m_term.set_scrollback_lines(m_opts.scrollback_lines);
+
+  m_display.AddFont(m_opts.font, m_opts.font_size);
+  return Resize(m_opts.width, m_opts.height);
+}
+
+Error Harness::Resize(int width, int height) {
+  auto info = SkImageInfo::Make(width, height, kRGBA_8888_SkColorType,
+                                kPremul_SkAlphaType);
+  m_surface = SkSurface::MakeRaster(info);
+  if (m_surface == nullptr) {
+    return Error::New("failed to create SkSurface");
+  }
+
+  m_surface->getCanvas()->clear(kDefaultTheme[Colors::kBackground]);
+
+  if (auto err = m_display.Resize(width, height)) {
+    return err.Extend("while resizing display");
+  }
+  return Error::New();
+}
+
+Error Harness::ResizeToCells(int cols, int rows) {
+  int width, height;
+  m_display.SizeForCells(cols, rows, &width, &height);
+  return Resize(width, height);
+}
+
+void Harness::Feed(absl::string_view output) {
+  auto parse_start = clock_type::now();
+  m_term.WriteToScreen(output);
+  auto frame_start = clock_type::now();
+  m_cells += m_term.Draw();
+  m_display.Draw(m_surface->getCanvas(), true);
+  auto frame_end = clock_type::now();
+
+  m_bytes += output.size();
+  m_parsing += frame_start - parse_start;
+  m_frame_times.push_back(Seconds(frame_end - frame_start));
+}
+
+void Harness::Report(absl::string_view name) {
+  double total_frame_time = 0;
+  for (double time : m_frame_times) {
+    total_frame_time += time;
+  }
+  std::sort(m_frame_times.begin(), m_frame_times.end());
+
+  auto attrs = m_term.attr_cache_stats();
+  double attr_hits = attrs.lookups ? 100.0 * attrs.hits / attrs.lookups : 0;
+  auto glyphs = m_display.glyph_cache_stats();
+  uint64 glyph_lookups = glyphs.hits + glyphs.misses;
+  double glyph_hits = glyph_lookups ? 100.0 * glyphs.hits / glyph_lookups : 0;
+
+  fmt::print("{:<10} {:>9.1f} MB/s {:>13.0f} cells/s    frame p50 {:>7.3f} ms"
+             "  p99 {:>7.3f} ms    attrs {:>5.1f}% cached    glyphs {:>5.1f}% cached\n",
+             string{name}, m_bytes / Seconds(m_parsing) / (1 << 20),
+             m_cells / total_frame_time, Percentile(m_frame_times, 0.5) * 1000,
+             Percentile(m_frame_times, 0.99) * 1000, attr_hits, glyph_hits);
+}
+
+static Error RunWorkload(const Options &opts, const Workload &workload) {
+  std::mt19937 rng;
+  string corpus = workload.generate(&rng);
+
+  Harness harness{opts};
+  if (auto err = harness.Initialize()) {
+    return err;
+  }
+
+  size_t offset = 0;
+  for (uint64 fed = 0; fed < opts.total_size; ) {
+    absl::string_view chunk{corpus};
+    chunk = chunk.substr(offset, opts.chunk_size);
+    offset = (offset + chunk.size()) % corpus.size();
+    fed += chunk.size();
+
+    harness.Feed(chunk);
+  }
+
+  harness.Report(workload.name);
+  return Error::New();
+}
+
+// Feeds a session saved with uterm --record back through, one frame per read the
+// terminal originally got. Input is skipped, since there's no child to send it to.
+static Error RunReplay(const Options &opts) {
+  Playback playback;
+  if (auto err = playback.Open(opts.replay_path)) {
+    return err;
+  }
+
+  Harness harness{opts};
+  if (auto err = harness.Initialize()) {
+    return err;
+  }
+
+  auto next_time = clock_type::now();
+  for (;;) {
+    Playback::Event event;
+    bool eof = false;
+    if (auto err = playback.Next(&event, &eof)) {
+      return err.Extend("while reading recording");
+    } else if (eof) {
+      break;
+    }
+
+    if (opts.realtime) {
+      next_time += event.delay;
+      std::this_thread::sleep_until(next_time);
+    }
+
+    switch (event.kind) {
+    case RecordKind::kOutput:
+      harness.Feed(event.data);
+      break;
+    case RecordKind::kInput:
+      break;
+    case RecordKind::kResize:
+      if (auto err = harness.ResizeToCells(event.cols, event.rows)) {
+        return err;
+      }
+      break;
+    }
+  }
+
+  harness.Report("replay");
+  return Error::New();
+}
+
+static void PrintUsage(const char *argv0) {
+  fmt::print(stderr, "usage: {} [--size MB] [--chunk KB] [--width PX] [--height PX]"
+                     " [--font NAME] [--font-size N] [--scrollback LINES]"
+                     " [workload...]\n", argv0);
+  fmt::print(stderr, "       {} [--realtime] [--font NAME] [--font-size N]"
+                     " --replay FILE\n", argv0);
+  if (kTracingBuilt) {
+    fmt::print(stderr, "either can also be given --trace FILE\n");
+  }
+  fmt::print(stderr, "workloads:");
+  for (auto &workload : kWorkloads) {
+    fmt::print(stderr, " {}", workload.name);
+  }
+  fmt::print(stderr, "\n");
+}
+
+static bool ParseOptions(int argc, char **argv, Options *opts) {
+  for (int i = 1; i < argc; i++) {
+    absl::string_view arg{argv[i]};
+    if (arg.empty() || arg[0] != '-') {
+      auto it = std::find_if(std::begin(kWorkloads), std::end(kWorkloads),
+                             [&](const Workload &workload) {
+                               return arg == workload.name;
+                             });
+      if (it == std::end(kWorkloads)) {
+        return false;
+      }
+
+      opts->workloads.push_back(string{arg});
+      continue;
+    } else if (arg == "--realtime") {
+      opts->realtime = true;
+      continue;
+    } else if (i + 1 == argc) {
+      return false;
+    }
+
+    absl::string_view value{argv[++i]};
+    int number = 0;
+    if (arg == "--font") {
+      opts->font = string{value};
+    } else if (arg == "--replay") {
+      opts->replay_path = string{value};
+    } else if (arg == "--trace" && kTracingBuilt) {
+      opts->trace_path = string{value};
+    } else if (!absl::SimpleAtoi(value, &number) || number <= 0) {
+      return false;
+    } else if (arg == "--size") {
+      opts->total_size = static_cast<uint64>(number) << 20;
+    } else if (arg == "--chunk") {
+      opts->chunk_size = static_cast<size_t>(number) << 10;
+    } else if (arg == "--width") {
+      opts->width = number;
+    } else if (arg == "--height") {
+      opts->height = number;
+    } else if (arg == "--font-size") {
+      opts->font_size = number;
+    } else if (arg == "--scrollback") {
+      opts->scrollback_lines = number;
+    } else {
+      return false;
+    }
+  }
+
+  // A replay is its own workload, so it can't be mixed with the canned ones, and only a
+  // replay has any timing to follow.
+  if (opts->replay_path.empty()) {
+    return !opts->realtime;
+  }
+  return opts->workloads.empty();
+}
+
+int main(int argc, char **argv) {
+  Options opts;
+  if (!ParseOptions(argc, argv, &opts)) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  if (!opts.trace_path.empty()) {
+    gTracer.Enable();
+  }
+
+  int ret = 0;
+  if (!opts.replay_path.empty()) {
+    if (auto err = RunReplay(opts)) {
+      err.Extend(fmt::format("while replaying {}", opts.replay_path)).Print();
+      ret = 1;
+    }
+  } else {
+    for (auto &workload : kWorkloads) {
+      if (!opts.workloads.empty() &&
+          std::find(opts.workloads.begin(), opts.workloads.end(), workload.name) ==
+            opts.workloads.end()) {
+        continue;
+      }
+
+      if (auto err = RunWorkload(opts, workload)) {
+        err.Extend(fmt::format("while running workload {}", workload.name)).Print();
+        ret = 1;
+      }
+    }
+  }
+
+  if (!opts.trace_path.empty()) {
+    if (auto err = gTracer.Write(opts.trace_path)) {
+      err.Extend("while saving trace").Print();
+    }
+  }
+
+  return ret;
+}
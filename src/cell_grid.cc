@@ -0,0 +1,119 @@
+#include "cell_grid.h"
+
+#include <algorithm>
+#include <string.h>
+
+constexpr uint32 CellGrid::kNoAttr;
+
+CellGrid::CellGrid(const Attr &default_attr): m_default{default_attr} {}
+
+void CellGrid::Resize(uint cols, uint rows) {
+  size_t old_size = size(), new_size = cols * rows;
+  m_cols = cols;
+  m_rows = rows;
+
+  for (size_t i = new_size; i < old_size; i++) {
+    ReleaseAttr(m_attr_ids[i]);
+  }
+
+  m_chars.assign(new_size, ' ');
+  m_fonts.assign(new_size, 0);
+  m_glyphs.assign(new_size, 0);
+
+  if (new_size > old_size) {
+    uint32 id = InternAttr(m_default);
+    m_attrs[id].refs += new_size - old_size;
+    m_attr_ids.resize(new_size, id);
+  } else {
+    m_attr_ids.resize(new_size);
+  }
+}
+
+void CellGrid::MoveRows(uint dest, uint src, uint count) {
+  size_t cells = count * m_cols;
+  assert(std::max(dest, src) * m_cols + cells <= size());
+
+  // The moved cells gain a reference before the ones they replace lose theirs, so that an
+  // attribute on both sides isn't freed in between.
+  for (size_t i = 0; i < cells; i++) {
+    m_attrs[m_attr_ids[src * m_cols + i]].refs++;
+  }
+  for (size_t i = 0; i < cells; i++) {
+    ReleaseAttr(m_attr_ids[dest * m_cols + i]);
+  }
+
+  memmove(&m_chars[dest * m_cols], &m_chars[src * m_cols], cells * sizeof(m_chars[0]));
+  memmove(&m_fonts[dest * m_cols], &m_fonts[src * m_cols], cells * sizeof(m_fonts[0]));
+  memmove(&m_glyphs[dest * m_cols], &m_glyphs[src * m_cols], cells * sizeof(m_glyphs[0]));
+  memmove(&m_attr_ids[dest * m_cols], &m_attr_ids[src * m_cols],
+          cells * sizeof(m_attr_ids[0]));
+}
+
+bool CellGrid::set_ch(size_t index, char32_t c) {
+  if (m_chars[index] == c) {
+    return false;
+  }
+
+  m_chars[index] = c;
+  return true;
+}
+
+void CellGrid::SetAttr(size_t begin, size_t end, const Attr &attr) {
+  assert(end <= size());
+  if (begin >= end) {
+    return;
+  }
+
+  uint32 id = InternAttr(attr);
+  for (size_t i = begin; i < end; i++) {
+    SetAttrId(i, id);
+  }
+}
+
+size_t CellGrid::SpanEnd(size_t begin, size_t end) const {
+  end = std::min(end, size());
+
+  size_t span_end = begin + 1;
+  while (span_end < end && m_attr_ids[span_end] == m_attr_ids[begin]) {
+    span_end++;
+  }
+  return span_end;
+}
+
+uint32 CellGrid::InternAttr(const Attr &attr) {
+  auto it = m_attr_indexes.find(attr);
+  if (it != m_attr_indexes.end()) {
+    return it->second;
+  }
+
+  uint32 id;
+  if (!m_free_attrs.empty()) {
+    id = m_free_attrs.back();
+    m_free_attrs.pop_back();
+    m_attrs[id] = {attr, 0};
+  } else {
+    id = m_attrs.size();
+    m_attrs.push_back({attr, 0});
+  }
+
+  m_attr_indexes.emplace(attr, id);
+  return id;
+}
+
+void CellGrid::SetAttrId(size_t index, uint32 id) {
+  uint32 old_id = m_attr_ids[index];
+  if (old_id == id) {
+    return;
+  }
+
+  m_attrs[id].refs++;
+  m_attr_ids[index] = id;
+  ReleaseAttr(old_id);
+}
+
+void CellGrid::ReleaseAttr(uint32 id) {
+  if (--m_attrs[id].refs == 0) {
+    m_attr_indexes.erase(m_attrs[id].attr);
+    m_free_attrs.push_back(id);
+  }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <SkScalar.h>
+
+#include <limits>
+#include <vector>
+
+#include "base.h"
+#include "attrs.h"
+#include "terminal.h"
+
+#define PHMAP_USE_ABSL_HASHEQ
+#include <parallel_hashmap/phmap.h>
+
+// A CellGrid holds everything a Display knows about each cell: its character, which font
+// draws it with which glyph, and its attribute. Each of those is kept in its own array,
+// indexed by y * cols + x, so a loop over one of them doesn't drag the rest through the
+// cache. Attributes are interned, and each cell only holds the index of its own.
+class CellGrid {
+public:
+  CellGrid(const Attr &default_attr);
+
+  uint cols() const { return m_cols; }
+  uint rows() const { return m_rows; }
+  size_t size() const { return m_chars.size(); }
+
+  uint PosToOffset(uint x, uint y) const { return y * m_cols + x; }
+  uint PosToOffset(Pos pos) const { return PosToOffset(pos.x, pos.y); }
+  Pos OffsetToPos(uint offset) const { return {offset % m_cols, offset / m_cols}; }
+
+  // Every cell's character is reset to a space with no glyph, since the old ones no longer
+  // line up with their cells. Any cells past the old end get the default attribute.
+  void Resize(uint cols, uint rows);
+  // Moves count rows from src to dest, which may overlap.
+  void MoveRows(uint dest, uint src, uint count);
+
+  char32_t ch(size_t index) const { return m_chars[index]; }
+  // Returns true if the cell's character changed.
+  bool set_ch(size_t index, char32_t c);
+
+  uint8_t font(size_t index) const { return m_fonts[index]; }
+  SkGlyphID glyph(size_t index) const { return m_glyphs[index]; }
+  const SkGlyphID * glyphs() const { return m_glyphs.data(); }
+  void set_glyph(size_t index, uint8_t font, SkGlyphID glyph) {
+    m_fonts[index] = font;
+    m_glyphs[index] = glyph;
+  }
+
+  const Attr & attr(size_t index) const { return m_attrs[m_attr_ids[index]].attr; }
+  void SetAttr(size_t begin, size_t end, const Attr &attr);
+  // Calls func on a copy of each cell's attribute, and gives it the result.
+  template <typename F>
+  void UpdateAttrs(size_t begin, size_t end, F func);
+  // Finds where the run of cells that share begin's attribute ends, stopping at end.
+  size_t SpanEnd(size_t begin, size_t end) const;
+private:
+  static constexpr uint32 kNoAttr = std::numeric_limits<uint32>::max();
+
+  struct AttrEntry {
+    Attr attr;
+    // How many cells have this attribute. Once none do, it's freed.
+    uint32 refs;
+  };
+
+  // Returns the index of the attribute, adding it (with no references yet) if needed.
+  uint32 InternAttr(const Attr &attr);
+  void SetAttrId(size_t index, uint32 id);
+  void ReleaseAttr(uint32 id);
+
+  uint m_cols{0}, m_rows{0};
+
+  std::vector<char32_t> m_chars;
+  std::vector<uint8_t> m_fonts;
+  std::vector<SkGlyphID> m_glyphs;
+  std::vector<uint32> m_attr_ids;
+
+  Attr m_default;
+  std::vector<AttrEntry> m_attrs;
+  phmap::flat_hash_map<Attr, uint32> m_attr_indexes;
+  std::vector<uint32> m_free_attrs;
+};
+
+template <typename F>
+void CellGrid::UpdateAttrs(size_t begin, size_t end, F func) {
+  // Neighbouring cells usually share an attribute, so only look up the new one when the
+  // old one changes.
+  uint32 old_id = kNoAttr, new_id = kNoAttr;
+
+  for (size_t i = begin; i < end; i++) {
+    if (m_attr_ids[i] != old_id) {
+      old_id = m_attr_ids[i];
+      Attr attr = m_attrs[old_id].attr;
+      func(attr);
+      new_id = InternAttr(attr);
+    }
+
+    SetAttrId(i, new_id);
+  }
+}
@@ -31,6 +31,11 @@ static string GetShell() {
   return shell ? shell : "/bin/sh";
 }
 
+static string GetRuntimeDir() {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  return dir ? dir : "/tmp";
+}
+
 static Expect<string> GetHome() {
   const char *home = getenv("HOME");
   if (home == nullptr) {
@@ -102,6 +107,7 @@ int VerifyColorCb(cfg_t *cfg, cfg_opt_t *opt, const char *c_value, void *v_resul
 
 Config::Config() {
   m_shell = GetShell();
+  m_scrollback_dir = GetRuntimeDir();
 }
 
 Error Config::Parse() {
@@ -156,8 +162,19 @@ Error Config::Parse() {
     // Note that the const_cast is only needed on libconfuse versions <v2.8.
     CFG_STR("shell", const_cast<char*>(m_shell.c_str()), CFGF_NONE),
     CFG_BOOL("hwaccel", cfg_true, CFGF_NONE),
+    CFG_BOOL("gpu-atlas", cfg_false, CFGF_NONE),
     CFG_INT("vsync", -1, CFGF_NONE),
     CFG_INT("fps", 120, CFGF_NONE),
+    CFG_BOOL("event-loop", cfg_false, CFGF_NONE),
+    CFG_INT("ring-buffer-size", kDefaultRingBufferSize, CFGF_NONE),
+    CFG_INT("read-size", kDefaultReadSize, CFGF_NONE),
+    CFG_BOOL("print-stats", cfg_false, CFGF_NONE),
+    CFG_INT("flood-threshold", kDefaultFloodThreshold, CFGF_NONE),
+    CFG_INT("flood-fps", kDefaultFloodFps, CFGF_NONE),
+    CFG_BOOL("latency-hud", cfg_false, CFGF_NONE),
+    CFG_STR("latency-dump", "", CFGF_NONE),
+    CFG_INT("scrollback-lines", kDefaultScrollbackLines, CFGF_NONE),
+    CFG_BOOL("scrollback-spill", cfg_true, CFGF_NONE),
 
     CFG_SEC("theme", theme_opts, CFGF_MULTI | CFGF_TITLE | CFGF_NO_TITLE_DUPES),
     CFG_STR("current-theme", "", CFGF_NONE),
@@ -179,8 +196,25 @@ Error Config::Parse() {
 
   m_shell = cfg_getstr(cfg, "shell");
   m_hwaccel = cfg_getbool(cfg, "hwaccel");
+  m_gpu_atlas = cfg_getbool(cfg, "gpu-atlas");
   m_vsync = cfg_getint(cfg, "vsync");
-  m_fps = cfg_getint(cfg, "fps");
+  m_fps = std::min(std::max(1L, cfg_getint(cfg, "fps")), static_cast<long>(kMaxFps));
+  m_event_loop = cfg_getbool(cfg, "event-loop");
+  m_ring_buffer_size = std::min(std::max(static_cast<long>(kMinRingBufferSize),
+                                         cfg_getint(cfg, "ring-buffer-size")),
+                                static_cast<long>(kMaxRingBufferSize));
+  m_read_size = std::min(std::max(1L, cfg_getint(cfg, "read-size")),
+                         static_cast<long>(m_ring_buffer_size));
+  m_print_stats = cfg_getbool(cfg, "print-stats");
+  m_flood_threshold = std::max(0L, cfg_getint(cfg, "flood-threshold"));
+  m_flood_fps = std::min(std::max(1L, cfg_getint(cfg, "flood-fps")),
+                         static_cast<long>(kMaxFps));
+  m_latency_hud = cfg_getbool(cfg, "latency-hud");
+  m_latency_dump = cfg_getstr(cfg, "latency-dump");
+  m_scrollback_lines = std::max(0L, cfg_getint(cfg, "scrollback-lines"));
+  if (!cfg_getbool(cfg, "scrollback-spill")) {
+    m_scrollback_dir.clear();
+  }
 
   const char *wanted_theme = cfg_getstr(cfg, "current-theme");
   int themes = cfg_size(cfg, "theme");
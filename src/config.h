@@ -42,15 +42,46 @@ public:
 
   const string & shell() const { return m_shell; }
   bool hwaccel() const { return m_hwaccel; }
+  bool gpu_atlas() const { return m_gpu_atlas; }
   int vsync() const { return m_vsync; }
   int fps() const { return m_fps; }
+  bool event_loop() const { return m_event_loop; }
+  int ring_buffer_size() const { return m_ring_buffer_size; }
+  int read_size() const { return m_read_size; }
+  bool print_stats() const { return m_print_stats; }
+  int flood_threshold() const { return m_flood_threshold; }
+  int flood_fps() const { return m_flood_fps; }
+  bool latency_hud() const { return m_latency_hud; }
+  const string & latency_dump() const { return m_latency_dump; }
+  int scrollback_lines() const { return m_scrollback_lines; }
+  // Where old scrollback is spilled to, or empty if it's all kept in memory.
+  const string & scrollback_dir() const { return m_scrollback_dir; }
   int font_defaults_size() const { return m_font_defaults_size; }
   const std::vector<Font> & fonts() const { return m_fonts; }
   const Theme & theme() const { return m_theme; }
 private:
   string m_shell;
-  bool m_hwaccel;
+  bool m_hwaccel, m_gpu_atlas;
   int m_vsync, m_fps;
+  bool m_event_loop{false};
+  // Frame intervals are counted in microseconds, so anything faster can't be timed.
+  static constexpr int kMaxFps = 1000000;
+
+  static constexpr int kDefaultRingBufferSize = 1 << 20;
+  static constexpr int kMinRingBufferSize = 4096, kMaxRingBufferSize = 1 << 30;
+  int m_ring_buffer_size{kDefaultRingBufferSize};
+  static constexpr int kDefaultReadSize = 64 * 1024;
+  int m_read_size{kDefaultReadSize};
+  bool m_print_stats{false};
+  static constexpr int kDefaultFloodThreshold = 8 << 20;
+  int m_flood_threshold{kDefaultFloodThreshold};
+  static constexpr int kDefaultFloodFps = 10;
+  int m_flood_fps{kDefaultFloodFps};
+  bool m_latency_hud{false};
+  string m_latency_dump;
+  static constexpr int kDefaultScrollbackLines = 10000;
+  int m_scrollback_lines{kDefaultScrollbackLines};
+  string m_scrollback_dir;
 
   static constexpr int kDefaultFontSize = 16;
   int m_font_defaults_size{kDefaultFontSize};
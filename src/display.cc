@@ -1,6 +1,13 @@
 #include "display.h"
+#include "trace.h"
 
 #include <absl/container/inlined_vector.h>
+#include <SkPixmap.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdlib.h>
+#include <string.h>
 
 // Clamps v to the range low (inclusive) to high (exclusive).
 template <typename T>
@@ -8,23 +15,43 @@ T clamp(T v, T low, T high) {
   return v < low ? low : (v > high ? high : v);
 }
 
-Display::Display(Terminal *term): m_term{term}, m_attrs{m_term->default_attr()} {
+// Works out which rows a scroll moves where, or returns false if it doesn't fit.
+static bool ScrollRows(const ScrollRegion &scroll, uint rows, uint *dest, uint *src,
+                       uint *count) {
+  uint distance = std::abs(scroll.shift);
+  if (scroll.bottom > rows || scroll.top + distance >= scroll.bottom) {
+    return false;
+  }
+
+  *count = scroll.bottom - scroll.top - distance;
+  *dest = scroll.shift > 0 ? scroll.top : scroll.top + distance;
+  *src = scroll.shift > 0 ? scroll.top + distance : scroll.top;
+  return true;
+}
+
+Display::Display(Terminal *term): m_term{term}, m_cells{m_term->default_attr()} {
   using namespace std::placeholders;
-  m_term->set_draw_cb(std::bind(&Display::TermDraw, this, _1, _2, _3, _4));
+  m_term->set_draw_cb(std::bind(&Display::TermDraw, this, _1));
+  m_term->set_scroll_cb(std::bind(&Display::TermScroll, this, _1));
 }
 
 void Display::AddFont(string name, int size) {
   m_renderers.emplace_back();
   m_renderers.back().SetFont(name);
   m_renderers.back().SetTextSize(size);
+  m_renderer_cols.resize(m_renderers.size());
+  m_resolved.clear();
 
   UpdateWidth();
   UpdateGlyphs();
+  for (auto &row : m_row_text) {
+    row.stale = true;
+  }
 }
 
 void Display::SetSelection(Selection state, int mx, int my) {
-  int x = clamp<int>(mx / m_char_width, 0, m_text.cols() - 1);
-  int y = clamp<int>(my / m_renderers[0].FindHeight(), 0, m_text.rows() - 1);
+  int x = clamp<int>(mx / m_char_width, 0, m_cells.cols() - 1);
+  int y = clamp<int>(my / m_renderers[0].FindHeight(), 0, m_cells.rows() - 1);
 
   m_term->SetSelection(state, x, y);
 }
@@ -39,18 +66,17 @@ Error Display::Resize(int width, int height) {
   int rows = (height - m_renderers[0].FindBaselineOffset()) / m_renderers[0].FindHeight();
   int cols = width / m_char_width;
 
-  m_text.Resize(cols, rows);
-
-  for (auto &renderer : m_renderers) {
-    renderer.Resize(rows * cols);
-  }
-  m_attrs.Resize(rows * cols);
+  // Nothing from the old grid's glyphs survives; every cell gets its glyph resolved again
+  // from whichever font now owns it.
+  m_cells.Resize(cols, rows);
+  UpdateGlyphs();
+  m_dirty_rows.assign(rows, true);
+  m_row_text.assign(rows, RowText{});
+  m_pending_scrolls.clear();
 
   auto err = m_term->Resize(cols, rows);
 
-  UpdatePositions();
-
-  m_attrs.UpdateWith(0, rows * cols, [](Attr &attr) {
+  m_cells.UpdateAttrs(0, m_cells.size(), [](Attr &attr) {
     attr.flags |= Attr::kDirty;
   });
   m_has_updated = true;
@@ -62,6 +88,46 @@ Error Display::Resize(int width, int height) {
   }
 }
 
+void Display::SizeForCells(int cols, int rows, int *width, int *height) {
+  assert(m_char_width != -1);
+
+  *width = std::ceil(cols * m_char_width);
+  *height = std::ceil(rows * m_renderers[0].FindHeight() +
+                      m_renderers[0].FindBaselineOffset());
+}
+
+void Display::Invalidate(const SkRect &rect) {
+  if (m_cells.cols() == 0 || m_cells.rows() == 0) {
+    return;
+  }
+
+  SkScalar height = m_renderers[0].FindHeight();
+  SkScalar offset = m_renderers[0].FindBaselineOffset();
+
+  int first_col = clamp<int>(rect.left() / m_char_width, 0, m_cells.cols() - 1);
+  int last_col = clamp<int>(std::ceil(rect.right() / m_char_width), 0, m_cells.cols());
+  int first_row = clamp<int>((rect.top() - offset) / height, 0, m_cells.rows() - 1);
+  int last_row = clamp<int>(std::ceil((rect.bottom() - offset) / height), 0,
+                            m_cells.rows());
+
+  MarkDirty(first_col, last_col, first_row, last_row);
+  m_overlaid = true;
+}
+
+void Display::MarkDirty(int first_col, int last_col, int first_row, int last_row) {
+  for (int y = first_row; y < last_row; y++) {
+    m_dirty_rows[y] = true;
+
+    size_t begin = m_cells.PosToOffset(first_col, y),
+           end = m_cells.PosToOffset(last_col, y);
+    m_cells.UpdateAttrs(begin, end, [](Attr &attr) {
+      attr.flags |= Attr::kDirty;
+    });
+  }
+
+  m_has_updated = true;
+}
+
 bool Display::Draw(SkCanvas *canvas, bool lazy_updating) {
   bool significant_redraw = m_has_updated;
 
@@ -69,97 +135,353 @@ bool Display::Draw(SkCanvas *canvas, bool lazy_updating) {
     return false;
   }
 
-  absl::InlinedVector<AttrSet::Span, 64> dirty;
-  AttrSet::Span *pspan = nullptr;
+  TraceScope trace{"Display::Draw"};
 
-  while ((pspan = m_attrs.NextSpan(pspan))) {
-    // XXX: should ignore dirty tracking if not lazy updating
-    if (!(pspan->data.flags & Attr::kDirty) && lazy_updating) continue;
+  if (lazy_updating) {
+    BlitScrolls(canvas);
+  } else {
+    // Everything's getting drawn over anyway.
+    m_pending_scrolls.clear();
+  }
 
-    bool inverse = pspan->data.flags & Attr::kInverse;
-    SkColor background;
-    if (pspan->data.flags & Attr::kInverse) {
-      background = pspan->data.foreground;
-    } else {
-      background = pspan->data.background;
-    }
+  // The spans of cells that were dirty, as their first and last indexes.
+  absl::InlinedVector<std::pair<size_t, size_t>, 64> dirty;
+  uint rows_visited = 0;
+
+  for (uint y = 0; y < m_cells.rows(); y++) {
+    // Rows that weren't touched can't have anything dirty in them, so don't bother
+    // walking their spans.
+    if (lazy_updating && !m_dirty_rows[y]) continue;
+    rows_visited++;
+
+    size_t row_begin = m_cells.PosToOffset(0, y), row_end = row_begin + m_cells.cols();
+    for (size_t begin = row_begin, end; begin < row_end; begin = end) {
+      end = m_cells.SpanEnd(begin, row_end);
+
+      const Attr &attr = m_cells.attr(begin);
+      // XXX: should ignore dirty tracking if not lazy updating
+      if (!(attr.flags & Attr::kDirty) && lazy_updating) continue;
+
+      SkColor background;
+      if (attr.flags & Attr::kInverse) {
+        background = attr.foreground;
+      } else {
+        background = attr.background;
+      }
 
-    HighlightRange(canvas, m_text.OffsetToPos(pspan->begin),
-                   m_text.OffsetToPos(pspan->end), background);
+      HighlightRange(canvas, m_cells.OffsetToPos(begin), m_cells.OffsetToPos(end),
+                     background);
 
-    dirty.push_back(*pspan);
+      dirty.emplace_back(begin, end);
+    }
   }
 
-  for (auto &span : dirty) {
-    bool is_primary = true;
-    for (auto &renderer : m_renderers) {
-      m_text.DrawRangeWithRenderer(canvas, &renderer, span.data, span.begin, span.end,
-                                   is_primary);
-      is_primary = false;
+  std::fill(m_dirty_rows.begin(), m_dirty_rows.end(), false);
+
+  uint cols = m_cells.cols();
+  SkScalar height = m_renderers[0].FindHeight();
+  for (size_t i = 0; i < dirty.size(); ) {
+    // Neighbouring spans in a row have their text drawn together, so a row that's all
+    // dirty has each of its blobs drawn just the once.
+    size_t begin = dirty[i].first, end = dirty[i].second, next = i + 1;
+    while (next < dirty.size() && dirty[next].first == end && end % cols != 0) {
+      end = dirty[next++].second;
     }
 
-    m_attrs.UpdateWith(span.begin, span.end, [](Attr &attr) {
-      attr.flags &= ~Attr::kDirty;
-    });
+    Pos pos = m_cells.OffsetToPos(begin);
+    DrawRowText(canvas, pos.y, pos.x, pos.x + end - begin);
+
+    for (; i < next; i++) {
+      Attr attr = m_cells.attr(dirty[i].first);
+      if (attr.flags & Attr::kUnderline) {
+        Pos first = m_cells.OffsetToPos(dirty[i].first);
+        m_renderers[0].DrawUnderline(canvas, attr, m_char_width * first.x,
+                                     m_char_width * (first.x + dirty[i].second -
+                                                     dirty[i].first),
+                                     height * (first.y + 1));
+      }
+
+      m_cells.UpdateAttrs(dirty[i].first, dirty[i].second, [](Attr &attr) {
+        attr.flags &= ~Attr::kDirty;
+      });
+    }
   }
 
-  m_has_updated = false;
+  trace.set_arg("rows", rows_visited);
+
+  m_has_updated = m_overlaid = false;
   return significant_redraw;
 }
 
-void Display::TermDraw(const u32string& str, Pos pos, Attr attr, int width) {
-  attr.flags |= Attr::kDirty;
+bool Display::DrawToAtlas(AtlasRenderer *atlas) {
+  if (!m_has_updated || m_cells.cols() == 0 || m_cells.rows() == 0) {
+    return false;
+  }
 
-  if (m_text.set_cell(pos.x, pos.y, str[0] ? str[0] : ' ')) {
-    UpdateGlyph(pos.x, pos.y);
+  TraceScope trace{"Display::DrawToAtlas"};
+
+  uint cols = m_cells.cols(), rows = m_cells.rows();
+  auto &primary = m_renderers[0];
+  SkScalar height = primary.FindHeight(), offset = primary.FindBaselineOffset();
+  SkScalar underline_offset, underline_thickness;
+  primary.FindUnderline(FontStyle::kNormal, &underline_offset, &underline_thickness);
+
+  // The text's baseline is at the bottom of the row, which starts offset further down.
+  AtlasRenderer::Grid grid;
+  grid.cols = cols;
+  grid.rows = rows;
+  grid.cell_width = m_char_width;
+  grid.cell_height = height;
+  grid.top = offset;
+  grid.baseline = height - offset;
+  grid.underline_y = grid.baseline + underline_offset - underline_thickness / 2;
+  grid.underline_height = std::max<SkScalar>(underline_thickness, 1);
+
+  if (atlas->SetGrid(grid)) {
+    MarkDirty(0, cols, 0, rows);
+    m_pending_scrolls.clear();
   }
 
-  m_attrs.Update(m_text.PosToOffset(pos), attr);
-  m_has_updated = true;
+  for (auto &scroll : m_pending_scrolls) {
+    uint dest, src, count;
+    if (ScrollRows(scroll, rows, &dest, &src, &count)) {
+      atlas->MoveCells(dest * cols, src * cols, count * cols);
+    }
+  }
+  m_pending_scrolls.clear();
+
+  // If the atlas fills up partway through, the slots from before then are gone, so start
+  // over with every cell. It's emptied out first, so the second go will fit.
+  for (int attempt = 0; attempt < 2; attempt++) {
+    uint64 generation = atlas->generation();
+    absl::InlinedVector<std::pair<size_t, size_t>, 64> dirty;
+
+    for (uint y = 0; y < rows; y++) {
+      if (!m_dirty_rows[y]) continue;
+
+      size_t row_begin = m_cells.PosToOffset(0, y), row_end = row_begin + cols;
+      for (size_t begin = row_begin, end; begin < row_end; begin = end) {
+        end = m_cells.SpanEnd(begin, row_end);
+        if (m_cells.attr(begin).flags & Attr::kDirty) {
+          UpdateAtlasCells(atlas, begin, end, m_cells.attr(begin));
+          dirty.emplace_back(begin, end);
+        }
+      }
+    }
+
+    if (atlas->generation() == generation) {
+      std::fill(m_dirty_rows.begin(), m_dirty_rows.end(), false);
+      for (auto &span : dirty) {
+        m_cells.UpdateAttrs(span.first, span.second, [](Attr &attr) {
+          attr.flags &= ~Attr::kDirty;
+        });
+      }
+      break;
+    }
+
+    MarkDirty(0, cols, 0, rows);
+  }
+
+  m_has_updated = m_overlaid = false;
+  return true;
 }
 
-void Display::UpdateWidth() {
-  m_char_width = m_renderers[0].FindWidth();
-  UpdatePositions();
+void Display::UpdateAtlasCells(AtlasRenderer *atlas, size_t begin, size_t end,
+                               const Attr &attr) {
+  FontStyle style = AttrsToFontStyle(attr);
+  bool inverse = attr.flags & Attr::kInverse;
+
+  AtlasRenderer::Cell cell;
+  cell.foreground = inverse ? attr.background : attr.foreground;
+  cell.background = inverse ? attr.foreground : attr.background;
+  cell.flags = attr.flags & Attr::kUnderline ? AtlasRenderer::kUnderline : 0;
+
+  for (size_t i = begin; i < end; i++) {
+    cell.slot = FindAtlasSlot(atlas, m_cells.ch(i), style);
+    atlas->SetCell(i, cell);
+  }
 }
 
-void Display::UpdatePositions() {
-  m_text.UpdatePositions(m_renderers[0].FindHeight(), m_char_width);
+uint32 Display::FindAtlasSlot(AtlasRenderer *atlas, char32_t c, FontStyle style) {
+  if (c == ' ' || c == 0) {
+    return AtlasRenderer::kNoGlyph;
+  }
+
+  uint64 key = static_cast<uint64>(c) << 8 | FontStyleToInt(style);
+  return atlas->FindSlot(key, [&](uint8_t *pixels, size_t row_bytes, int width,
+                                  int height) {
+    auto canvas = SkCanvas::MakeRasterDirect(SkImageInfo::MakeA8(width, height), pixels,
+                                             row_bytes);
+    SkPoint origin = SkPoint::Make(0, atlas->grid().baseline);
+
+    uint8_t renderer;
+    SkGlyphID glyph;
+    ResolveGlyph(c, style, &renderer, &glyph);
+    m_renderers[renderer].DrawGlyph(canvas.get(), glyph, style, origin);
+  });
 }
 
-void Display::UpdateGlyphs() {
-  for (int i=0; i<m_text.rows(); i++) {
-    for (int j=0; j<m_text.cols(); j++) {
-      UpdateGlyph(i, j);
+void Display::TermDraw(const CellRun &run) {
+  // The snapshot may have been taken before the last resize.
+  if (run.pos.x >= m_cells.cols() || run.pos.y >= m_cells.rows()) {
+    return;
+  }
+
+  uint count = std::min<uint>(run.chars.size(), m_cells.cols() - run.pos.x);
+  uint begin = m_cells.PosToOffset(run.pos);
+
+  // The whole run shares one attribute, so it's set in one go. This comes first, since
+  // the glyphs' font styles depend on it.
+  Attr attr = run.attr;
+  attr.flags |= Attr::kDirty;
+  m_cells.SetAttr(begin, begin + count, attr);
+  m_dirty_rows[run.pos.y] = true;
+  m_row_text[run.pos.y].stale = true;
+
+  for (uint i = 0; i < count; i++) {
+    char32_t c = run.chars[i];
+    if (m_cells.set_ch(begin + i, c ? c : ' ')) {
+      UpdateGlyph(begin + i);
+    }
+  }
+
+  m_has_updated = true;
+}
+
+void Display::TermScroll(const ScrollRegion &scroll) {
+  // The snapshot may have been taken before the last resize, in which case everything is
+  // getting redrawn anyway.
+  uint dest, src, count;
+  if (!ScrollRows(scroll, m_cells.rows(), &dest, &src, &count)) {
+    return;
+  }
+
+  // Cells that were dirty still are wherever they ended up.
+  m_cells.MoveRows(dest, src, count);
+  if (dest < src) {
+    std::copy(m_dirty_rows.begin() + src, m_dirty_rows.begin() + src + count,
+              m_dirty_rows.begin() + dest);
+    std::move(m_row_text.begin() + src, m_row_text.begin() + src + count,
+              m_row_text.begin() + dest);
+  } else {
+    std::copy_backward(m_dirty_rows.begin() + src, m_dirty_rows.begin() + src + count,
+                       m_dirty_rows.begin() + dest + count);
+    std::move_backward(m_row_text.begin() + src, m_row_text.begin() + src + count,
+                       m_row_text.begin() + dest + count);
+  }
+  // The rows left behind are about to be drawn over by the terminal.
+  for (uint y = src; y < src + count; y++) {
+    if (y < dest || y >= dest + count) {
+      m_row_text[y].stale = true;
     }
   }
+
+  m_pending_scrolls.push_back(scroll);
+  m_has_updated = true;
 }
 
-void Display::UpdateGlyph(int x, int y) {
-  int index = m_text.PosToOffset(x, y);
-  if (index >= m_attrs.size()) {
+void Display::BlitScrolls(SkCanvas *canvas) {
+  if (m_pending_scrolls.empty()) {
     return;
   }
 
-  char32_t c = m_text.cell(x, y);
-  FontStyle style = AttrsToFontStyle(m_attrs.At(index));
+  // Only a raster canvas has pixels that can be moved around directly.
+  SkPixmap pixmap;
+  bool blit = !m_overlaid && canvas->peekPixels(&pixmap);
+
+  SkScalar height = m_renderers[0].FindHeight();
+  SkScalar offset = m_renderers[0].FindBaselineOffset();
+  for (auto &scroll : m_pending_scrolls) {
+    uint dest, src, count;
+    if (!ScrollRows(scroll, m_cells.rows(), &dest, &src, &count)) {
+      continue;
+    }
 
-  bool found_success = false;
+    // Pixels can only be moved by a whole number of them. If the rows are a fraction of a
+    // pixel tall and the scroll doesn't add up to whole pixels, they're redrawn instead.
+    SkScalar shift = (static_cast<SkScalar>(src) - dest) * height;
+    if (!blit || shift != std::round(shift)) {
+      MarkDirty(0, m_cells.cols(), dest, dest + count);
+      continue;
+    }
+
+    // Only the pixels wholly inside the moved rows are copied. The rows at either end
+    // redraw the pixel they share with a row that didn't move, if there is one.
+    SkScalar top = offset + dest * height, bottom = top + count * height;
+    int dest_y = std::ceil(top), dest_end = std::floor(bottom);
+    if (dest_y != top) {
+      MarkDirty(0, m_cells.cols(), dest, dest + 1);
+    }
+    if (dest_end != bottom) {
+      MarkDirty(0, m_cells.cols(), dest + count - 1, dest + count);
+    }
+
+    int src_y = dest_y + static_cast<int>(shift);
+    int lines = std::min(dest_end - dest_y, pixmap.height() - std::max(dest_y, src_y));
+    if (lines > 0) {
+      char *pixels = static_cast<char*>(pixmap.writable_addr());
+      memmove(pixels + dest_y * pixmap.rowBytes(), pixels + src_y * pixmap.rowBytes(),
+              lines * pixmap.rowBytes());
+    }
+  }
+
+  m_pending_scrolls.clear();
+}
+
+GlyphCacheStats Display::glyph_cache_stats() {
+  GlyphCacheStats stats;
   for (auto &renderer : m_renderers) {
-    if (found_success) {
-      renderer.ClearGlyph(index);
-    } else {
-      found_success = renderer.UpdateGlyph(c, index, style);
-      if (!found_success) {
-        renderer.ClearGlyph(index);
-      }
+    stats += renderer.glyph_cache_stats();
+  }
+  return stats;
+}
+
+void Display::UpdateWidth() {
+  m_char_width = m_renderers[0].FindWidth();
+}
+
+void Display::UpdateGlyphs() {
+  for (size_t i = 0; i < m_cells.size(); i++) {
+    UpdateGlyph(i);
+  }
+}
+
+void Display::UpdateGlyph(size_t index) {
+  uint8_t renderer;
+  SkGlyphID glyph;
+  ResolveGlyph(m_cells.ch(index), AttrsToFontStyle(m_cells.attr(index)), &renderer,
+               &glyph);
+  m_cells.set_glyph(index, renderer, glyph);
+}
+
+void Display::ResolveGlyph(char32_t c, FontStyle style, uint8_t *renderer,
+                           SkGlyphID *glyph) {
+  // Once a terminal's been running for a while, this should have everything it shows, so
+  // it's just a guard against something spewing every codepoint there is.
+  constexpr size_t kMaxResolved = 16384;
+
+  uint64 key = static_cast<uint64>(c) << 8 | FontStyleToInt(style);
+  auto it = m_resolved.find(key);
+  if (it != m_resolved.end()) {
+    *renderer = it->second.renderer;
+    *glyph = it->second.glyph;
+    return;
+  }
+
+  *renderer = 0;
+  *glyph = 0;
+  for (size_t i = 0; i < m_renderers.size(); i++) {
+    if (SkGlyphID found = m_renderers[i].FindGlyph(c, style)) {
+      *renderer = i;
+      *glyph = found;
+      break;
     }
   }
 
-  // Fallback to the first renderer if a glyph cannot be found.
-  if (!found_success) {
-    m_renderers[0].UpdateGlyph(c, index, style);
+  if (m_resolved.size() >= kMaxResolved) {
+    m_resolved.clear();
   }
+  m_resolved.emplace(key, ResolvedGlyph{*renderer, *glyph});
 }
 
 void Display::HighlightRange(SkCanvas *canvas, Pos begin, Pos end, SkColor color) {
@@ -167,7 +489,7 @@ void Display::HighlightRange(SkCanvas *canvas, Pos begin, Pos end, SkColor color
 
   for (int y = begin.y; y <= end.y; y++) {
     int first = y == begin.y ? begin.x : 0,
-        last = y == end.y ? end.x : m_text.cols();
+        last = y == end.y ? end.x : m_cells.cols();
     SkRect rect = SkRect::MakeXYWH(m_char_width * first,
                                    m_renderers[0].FindHeight() * y +
                                     m_renderers[0].FindBaselineOffset(),
@@ -179,3 +501,82 @@ void Display::HighlightRange(SkCanvas *canvas, Pos begin, Pos end, SkColor color
     canvas->restore();
   }
 }
+
+void Display::DrawRowText(SkCanvas *canvas, uint y, uint first_col, uint last_col) {
+  RowText &row = m_row_text[y];
+  if (row.stale) {
+    BuildRowText(y);
+  }
+
+  SkScalar height = m_renderers[0].FindHeight();
+  SkScalar offset = m_renderers[0].FindBaselineOffset();
+
+  // Only the given columns had their backgrounds cleared, so the blobs that run past them
+  // mustn't draw over their neighbours again.
+  bool clip = first_col != 0 || last_col != m_cells.cols();
+  if (clip) {
+    canvas->save();
+    canvas->clipRect(SkRect::MakeLTRB(m_char_width * first_col, offset + height * y,
+                                      m_char_width * last_col, offset + height * (y + 1)),
+                     false);
+  }
+
+  for (auto &blob : row.blobs) {
+    if (blob.last_col > first_col && blob.first_col < last_col) {
+      m_renderers[blob.renderer].DrawBlob(canvas, blob.blob, blob.attr, height * (y + 1));
+    }
+  }
+
+  if (clip) {
+    canvas->restore();
+  }
+}
+
+void Display::BuildRowText(uint y) {
+  TraceScope trace{"Display::BuildRowText"};
+
+  RowText &row = m_row_text[y];
+  row.blobs.clear();
+
+  // Spans that differ only in whether they're dirty have the same text.
+  auto same_text = [](const Attr &a, const Attr &b) {
+    return a.foreground == b.foreground && a.background == b.background &&
+           (a.flags | Attr::kDirty) == (b.flags | Attr::kDirty);
+  };
+
+  size_t row_begin = m_cells.PosToOffset(0, y), row_end = row_begin + m_cells.cols();
+  for (size_t begin = row_begin, end; begin < row_end; begin = end) {
+    Attr attr = m_cells.attr(begin);
+    attr.flags &= ~Attr::kDirty;
+
+    end = m_cells.SpanEnd(begin, row_end);
+    while (end < row_end && same_text(m_cells.attr(end), attr)) {
+      end = m_cells.SpanEnd(end, row_end);
+    }
+
+    // Hand each renderer just the columns it has glyphs for. Blanks are left out, since
+    // their background is cleared before the text is drawn.
+    for (auto &cols : m_renderer_cols) {
+      cols.clear();
+    }
+    for (size_t i = begin; i < end; i++) {
+      char32_t c = m_cells.ch(i);
+      if (c != ' ' && c != 0) {
+        m_renderer_cols[m_cells.font(i)].push_back(i - row_begin);
+      }
+    }
+
+    FontStyle style = AttrsToFontStyle(attr);
+    for (size_t i = 0; i < m_renderers.size(); i++) {
+      if (m_renderer_cols[i].empty()) continue;
+
+      auto blob = m_renderers[i].MakeBlob(style, m_cells.glyphs() + row_begin,
+                                          m_renderer_cols[i], m_char_width);
+      row.blobs.push_back({static_cast<uint>(begin - row_begin),
+                           static_cast<uint>(end - row_begin), static_cast<uint8_t>(i),
+                           attr, std::move(blob)});
+    }
+  }
+
+  row.stale = false;
+}
@@ -5,9 +5,10 @@
 #include <SkPaint.h>
 
 #include "base.h"
+#include "atlas_renderer.h"
+#include "cell_grid.h"
 #include "terminal.h"
 #include "text.h"
-#include "marker_set.h"
 
 class Display {
 public:
@@ -19,23 +20,79 @@ public:
   void EndSelection();
 
   Error Resize(int width, int height);
+  // Finds the smallest size that Resize would fit the given columns and rows into.
+  void SizeForCells(int cols, int rows, int *width, int *height);
+  // Marks every cell under the given rectangle (e.g. something drawn on top of them) to
+  // be drawn again.
+  void Invalidate(const SkRect &rect);
   bool Draw(SkCanvas *canvas, bool lazy_updating);
+  // Like Draw, but only updates the cells that changed in the atlas renderer, which then
+  // draws the whole grid itself.
+  bool DrawToAtlas(AtlasRenderer *atlas);
+
+  // The totals over every font's glyph caches.
+  GlyphCacheStats glyph_cache_stats();
 private:
-  void TermDraw(const u32string& str, Pos pos, Attr attr, int width);
+  void TermDraw(const CellRun &run);
+  void TermScroll(const ScrollRegion &scroll);
+  // Applies the scrolls since the last Draw to what's already on the canvas, by moving
+  // its pixels if possible, or else by marking the rows they moved to dirty.
+  void BlitScrolls(SkCanvas *canvas);
+  void MarkDirty(int first_col, int last_col, int first_row, int last_row);
   void UpdateWidth();
-  void UpdatePositions();
   void UpdateGlyphs();
-  void UpdateGlyph(int x, int y);
+  void UpdateGlyph(size_t index);
+  // Finds which renderer draws c in the given style, and with which glyph: the first one
+  // whose font has it, or else the first renderer's missing glyph.
+  void ResolveGlyph(char32_t c, FontStyle style, uint8_t *renderer, SkGlyphID *glyph);
   void HighlightRange(SkCanvas *canvas, Pos begin, Pos end, SkColor color);
+  // Draws the text of the given columns of a row, building its blobs first if needed.
+  void DrawRowText(SkCanvas *canvas, uint y, uint first_col, uint last_col);
+  void BuildRowText(uint y);
+  // Sets the atlas's cell from the given span of cells that all share the one attribute.
+  void UpdateAtlasCells(AtlasRenderer *atlas, size_t begin, size_t end, const Attr &attr);
+  uint32 FindAtlasSlot(AtlasRenderer *atlas, char32_t c, FontStyle style);
 
   Terminal *m_term;
   SkScalar m_char_width{-1};
 
-  TextManager m_text;
+  CellGrid m_cells;
   std::vector<GlyphRenderer> m_renderers;
+  // The columns of the span being built that each renderer has glyphs for, kept around
+  // between spans so they don't need allocating again.
+  std::vector<std::vector<uint>> m_renderer_cols;
+
+  // One renderer's text for a span of a row that shares an attribute. The blob doesn't
+  // depend on which row it's in, so it can move along with it.
+  struct RowBlob {
+    uint first_col, last_col;
+    uint8_t renderer;
+    Attr attr;
+    sk_sp<SkTextBlob> blob;
+  };
+  // The blobs for each row, which are kept between frames until the row changes, so
+  // drawing an unchanged row (e.g. on every frame with hwaccel) doesn't make new ones.
+  struct RowText {
+    bool stale{true};
+    std::vector<RowBlob> blobs;
+  };
+  std::vector<RowText> m_row_text;
 
-  using AttrSet = MarkerSet<Attr>;
-  AttrSet m_attrs;
+  struct ResolvedGlyph {
+    uint8_t renderer;
+    SkGlyphID glyph;
+  };
+  // Past results of ResolveGlyph, keyed by the codepoint and style. They only change
+  // when a font is added, so this is cleared then (or if it gets too big).
+  phmap::flat_hash_map<uint64, ResolvedGlyph> m_resolved;
 
   bool m_has_updated{false};
+  // Which rows the terminal has drawn to (or that need drawing again for some other
+  // reason) since the last Draw. Nothing outside of them can be dirty.
+  std::vector<bool> m_dirty_rows;
+  // The cells have already been moved for these, but the pixels haven't.
+  std::vector<ScrollRegion> m_pending_scrolls;
+  // Set if something was drawn on top of the cells since the last Draw. It'd get moved
+  // along with them, so nothing is blitted until the next one.
+  bool m_overlaid{false};
 };
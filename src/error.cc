@@ -89,4 +89,5 @@ template <typename T>
 T* Expect<T>::operator ->() { return &**this; }
 
 // XXX
+template class Expect<int>;
 template class Expect<string>;
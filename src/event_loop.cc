@@ -0,0 +1,113 @@
+#include "event_loop.h"
+#include "trace.h"
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+EventLoop::~EventLoop() {
+  if (m_epoll != -1) {
+    close(m_epoll);
+  }
+}
+
+Error EventLoop::Initialize() {
+  m_epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (m_epoll == -1) {
+    return Error::Errno().Extend("creating epoll instance");
+  }
+
+  return Error::New();
+}
+
+Error EventLoop::Add(int fd, uint32 events, Handler handler) {
+  epoll_event event;
+  event.events = events;
+  event.data.fd = fd;
+
+  if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) == -1) {
+    return Error::Errno().Extend(fmt::format("adding fd {} to epoll", fd));
+  }
+
+  m_handlers[fd] = std::move(handler);
+  return Error::New();
+}
+
+Error EventLoop::Modify(int fd, uint32 events) {
+  epoll_event event;
+  event.events = events;
+  event.data.fd = fd;
+
+  if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &event) == -1) {
+    return Error::Errno().Extend(fmt::format("modifying fd {} in epoll", fd));
+  }
+
+  return Error::New();
+}
+
+Error EventLoop::Poll(int timeout) {
+  constexpr int kMaxEvents = 16;
+  epoll_event events[kMaxEvents];
+
+  int ready;
+  {
+    TraceScope trace{"EventLoop::Wait"};
+    ready = epoll_wait(m_epoll, events, kMaxEvents, timeout);
+  }
+
+  if (ready == -1) {
+    if (errno == EINTR) {
+      return Error::New();
+    }
+    return Error::Errno().Extend("waiting on epoll");
+  }
+
+  for (int i = 0; i < ready; i++) {
+    auto it = m_handlers.find(events[i].data.fd);
+    if (it != m_handlers.end()) {
+      it->second(events[i].events);
+    }
+  }
+
+  return Error::New();
+}
+
+Expect<int> OpenChildExitFd(int pid) {
+  int fd = syscall(SYS_pidfd_open, pid, 0);
+  if (fd != -1) {
+    return Expect<int>::New(fd);
+  } else if (errno != ENOSYS) {
+    return Expect<int>::New(Error::Errno().Extend("opening pidfd for child"));
+  }
+
+  // Older kernels don't have pidfds, so fall back to a signalfd for SIGCHLD. This only
+  // works if it's opened before any other threads are started, since the signal has to
+  // be blocked in all of them.
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+
+  if (sigprocmask(SIG_BLOCK, &mask, nullptr) == -1) {
+    return Expect<int>::New(Error::Errno().Extend("blocking SIGCHLD"));
+  }
+
+  fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (fd == -1) {
+    return Expect<int>::New(Error::Errno().Extend("opening signalfd for SIGCHLD"));
+  }
+
+  return Expect<int>::New(fd);
+}
+
+void DrainChildExitFd(int fd) {
+  // pidfds can't be read from, so this fails right away on them. The signalfd is
+  // non-blocking, so it stops once there's nothing left.
+  signalfd_siginfo info;
+  while (read(fd, &info, sizeof(info)) == sizeof(info)) {}
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "base.h"
+#include "error.h"
+
+#include <functional>
+
+#define PHMAP_USE_ABSL_HASHEQ
+#include <parallel_hashmap/phmap.h>
+
+// An EventLoop waits on a set of file descriptors using epoll, and calls the handler
+// registered for each one that becomes ready. It's only ever used from one thread.
+class EventLoop {
+public:
+  using Handler = std::function<void(uint32 events)>;
+
+  ~EventLoop();
+
+  Error Initialize();
+
+  // Starts watching fd for the given epoll events.
+  Error Add(int fd, uint32 events, Handler handler);
+  // Changes the epoll events fd is being watched for.
+  Error Modify(int fd, uint32 events);
+
+  // Waits up to timeout milliseconds (or forever if -1) for any watched fd to become
+  // ready, and then runs the handlers of all the ready ones.
+  Error Poll(int timeout);
+private:
+  int m_epoll{-1};
+  phmap::flat_hash_map<int, Handler> m_handlers;
+};
+
+// Returns an fd that becomes readable once the given child process exits, or -1 with an
+// error if neither pidfds nor signalfds are usable.
+Expect<int> OpenChildExitFd(int pid);
+// Clears whatever made a child exit fd readable. A signalfd stays readable until its
+// SIGCHLDs are read, even ones for a child that only stopped, so this has to be called
+// each time it is. On a pidfd it does nothing.
+void DrainChildExitFd(int fd);
@@ -14,7 +14,7 @@ static Error ExtendErrorWithLog(GLchar *log, Error err) {
   return err;
 }
 
-static Error CompileShader(GLuint shader, const char *source) {
+Error CompileShader(GLuint shader, const char *source) {
   glShaderSource(shader, 1, &source, NULL);
   glCompileShader(shader);
 
@@ -29,7 +29,7 @@ static Error CompileShader(GLuint shader, const char *source) {
   return Error::New();
 }
 
-static Error LinkProgram(GLuint program, GLuint vertex_shader, GLuint fragment_shader) {
+Error LinkProgram(GLuint program, GLuint vertex_shader, GLuint fragment_shader) {
   glAttachShader(program, vertex_shader);
   glAttachShader(program, fragment_shader);
   glLinkProgram(program);
@@ -5,6 +5,11 @@
 
 #include <epoxy/gl.h>
 
+#include <limits>
+
+Error CompileShader(GLuint shader, const char *source);
+Error LinkProgram(GLuint program, GLuint vertex_shader, GLuint fragment_shader);
+
 class GLManager {
 public:
   void Resize(int width, int height);
@@ -12,7 +17,9 @@ public:
 
   void UpdateTextureData(const void *data);
   void Draw();
-private:
+
+  // Owners of GL object ids, which delete them when destroyed. AtlasRenderer uses these
+  // too.
   struct ShaderId {
     void operator()(GLuint id) { glDeleteShader(id); }
   };
@@ -48,7 +55,7 @@ private:
     GLuint m_id{std::numeric_limits<GLuint>::max()};
     C m_clear;
   };
-
+private:
   int m_width{-1}, m_height{-1};
 
   IdWrapper<ShaderId> m_vertex, m_fragment;
@@ -0,0 +1,26 @@
+// This lives in its own file to keep Xlib's macros away from everything else.
+
+#include "glfw_native.h"
+
+#include <GLFW/glfw3.h>
+
+#ifdef __linux__
+#define GLFW_EXPOSE_NATIVE_X11
+#include <GLFW/glfw3native.h>
+#endif
+
+int GlfwConnectionFd() {
+  #ifdef __linux__
+  #if GLFW_VERSION_MAJOR > 3 || (GLFW_VERSION_MAJOR == 3 && GLFW_VERSION_MINOR >= 4)
+  if (glfwGetPlatform() != GLFW_PLATFORM_X11) {
+    return -1;
+  }
+  #endif
+
+  if (::Display *display = glfwGetX11Display()) {
+    return XConnectionNumber(display);
+  }
+  #endif
+
+  return -1;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+// Returns the fd of GLFW's connection to the window system, which becomes readable
+// whenever there are window events to be processed, or -1 if the current platform
+// doesn't have one we know about.
+int GlfwConnectionFd();
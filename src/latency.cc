@@ -0,0 +1,168 @@
+#include "latency.h"
+
+#include <SkFont.h>
+#include <SkPaint.h>
+
+#include <algorithm>
+
+constexpr std::chrono::seconds LatencyTracker::kEchoTimeout;
+constexpr size_t LatencyTracker::kRecentSamples;
+
+LatencyTracker::~LatencyTracker() {
+  if (auto err = CloseDump()) {
+    err.Print();
+  }
+}
+
+void LatencyTracker::KeyPressed(clock::time_point when) {
+  std::unique_lock<std::mutex> lock{m_lock};
+  m_awaiting_output.push_back(when);
+  m_waiting.store(m_awaiting_output.size());
+}
+
+void LatencyTracker::OutputParsed() {
+  if (m_waiting.load() == 0) {
+    return;
+  }
+
+  auto now = clock::now();
+
+  std::unique_lock<std::mutex> lock{m_lock};
+  for (auto pressed : m_awaiting_output) {
+    if (now - pressed < kEchoTimeout) {
+      m_awaiting_frame.push_back(pressed);
+    }
+  }
+
+  m_awaiting_output.clear();
+  m_waiting.store(0);
+}
+
+void LatencyTracker::FrameStarted() {
+  std::unique_lock<std::mutex> lock{m_lock};
+  m_drawing.insert(m_drawing.end(), m_awaiting_frame.begin(), m_awaiting_frame.end());
+  m_awaiting_frame.clear();
+}
+
+void LatencyTracker::FramePresented() {
+  auto now = clock::now();
+
+  std::unique_lock<std::mutex> lock{m_lock};
+  for (auto pressed : m_drawing) {
+    auto sample = std::chrono::duration_cast<std::chrono::microseconds>(now - pressed);
+    m_samples[m_next_sample] = sample;
+    m_next_sample = (m_next_sample + 1) % kRecentSamples;
+    m_sample_count = std::min(m_sample_count + 1, kRecentSamples);
+
+    if (m_dump != nullptr) {
+      fmt::print(m_dump, "{}\n", sample.count());
+    }
+  }
+  m_drawing.clear();
+}
+
+SkRect LatencyTracker::HudBounds(int width) {
+  constexpr SkScalar kWidth = 280, kHeight = 100, kMargin = 8;
+  return SkRect::MakeXYWH(width - kWidth - kMargin, kMargin, kWidth, kHeight);
+}
+
+static double Milliseconds(std::chrono::microseconds duration) {
+  return duration.count() / 1000.0;
+}
+
+void LatencyTracker::DrawHud(SkCanvas *canvas, const SkRect &bounds) {
+  constexpr int kBuckets = 16;
+  constexpr auto kBucketSize = std::chrono::milliseconds{4};
+  constexpr SkScalar kPadding = 8, kTextSize = 12;
+
+  std::vector<std::chrono::microseconds> recent;
+  {
+    std::unique_lock<std::mutex> lock{m_lock};
+    // Order doesn't matter here, so the ring's contents can be taken as-is.
+    recent.assign(m_samples.begin(), m_samples.begin() + m_sample_count);
+  }
+
+  // The last bucket also holds everything slower than it.
+  int counts[kBuckets] = {0};
+  for (auto sample : recent) {
+    counts[std::min<int>(sample / kBucketSize, kBuckets - 1)]++;
+  }
+
+  string text;
+  if (recent.empty()) {
+    text = "latency: no samples yet";
+  } else {
+    std::sort(recent.begin(), recent.end());
+    auto percentile = [&](double p) {
+      return Milliseconds(recent[std::min(recent.size() - 1,
+                                          static_cast<size_t>(recent.size() * p))]);
+    };
+
+    text = fmt::format("p50 {:.1f}ms  p99 {:.1f}ms  max {:.1f}ms", percentile(0.5),
+                       percentile(0.99), Milliseconds(recent.back()));
+  }
+
+  SkPaint paint;
+  paint.setColor(SkColorSetARGB(0xe0, 0x10, 0x10, 0x10));
+  canvas->drawRect(bounds, paint);
+
+  SkFont font;
+  font.setSize(kTextSize);
+  paint.setColor(SK_ColorWHITE);
+  canvas->drawSimpleText(text.data(), text.size(), kUTF8_SkTextEncoding,
+                         bounds.left() + kPadding, bounds.top() + kPadding + kTextSize,
+                         font, paint);
+
+  SkScalar bottom = bounds.bottom() - kPadding;
+  SkScalar max_height = bottom - (bounds.top() + kPadding * 2 + kTextSize);
+  SkScalar bar_width = (bounds.width() - kPadding * 2) / kBuckets;
+  int max_count = std::max(1, *std::max_element(std::begin(counts), std::end(counts)));
+
+  for (int i = 0; i < kBuckets; i++) {
+    if (counts[i] == 0) {
+      continue;
+    }
+
+    // Green for under a 60Hz frame, then yellow for under two of them, then red.
+    auto start = kBucketSize * i;
+    if (start < std::chrono::milliseconds{16}) {
+      paint.setColor(SkColorSetRGB(0x4c, 0xaf, 0x50));
+    } else if (start < std::chrono::milliseconds{32}) {
+      paint.setColor(SkColorSetRGB(0xff, 0xc1, 0x07));
+    } else {
+      paint.setColor(SkColorSetRGB(0xf4, 0x43, 0x36));
+    }
+
+    SkScalar left = bounds.left() + kPadding + bar_width * i;
+    SkScalar height = max_height * counts[i] / max_count;
+    canvas->drawRect(SkRect::MakeLTRB(left + 1, bottom - height, left + bar_width - 1,
+                                      bottom), paint);
+  }
+}
+
+Error LatencyTracker::OpenDump(const string &path) {
+  std::unique_lock<std::mutex> lock{m_lock};
+
+  m_dump = fopen(path.c_str(), "we");
+  if (m_dump == nullptr) {
+    return Error::Errno().Extend(fmt::format("opening {}", path));
+  }
+  return Error::New();
+}
+
+Error LatencyTracker::CloseDump() {
+  std::unique_lock<std::mutex> lock{m_lock};
+
+  if (m_dump == nullptr) {
+    return Error::New();
+  }
+
+  bool failed = ferror(m_dump);
+  failed = fclose(m_dump) != 0 || failed;
+  m_dump = nullptr;
+
+  if (failed) {
+    return Error::New("failed to write latencies");
+  }
+  return Error::New();
+}
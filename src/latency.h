@@ -0,0 +1,59 @@
+#pragma once
+
+#include "base.h"
+#include "error.h"
+
+#include <SkCanvas.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include <stdio.h>
+
+// A LatencyTracker measures how long it takes from a key press until its echo is on the
+// screen. Each key press is matched up with the first output parsed after it, and then
+// with the first frame that started drawing after that.
+class LatencyTracker {
+public:
+  using clock = std::chrono::steady_clock;
+
+  ~LatencyTracker();
+
+  // Called on the render thread once a key press has been written to the pty.
+  void KeyPressed(clock::time_point when);
+  // Called from whichever thread parses the pty's output, after each batch.
+  void OutputParsed();
+  // Called on the render thread right before the terminal is drawn, and again once the
+  // frame has been swapped onto the screen.
+  void FrameStarted();
+  void FramePresented();
+
+  // Where the overlay goes on a canvas of the given width.
+  SkRect HudBounds(int width);
+  // Draws a histogram of the recent latencies within the given bounds.
+  void DrawHud(SkCanvas *canvas, const SkRect &bounds);
+  // Starts writing every latency measured from now on to the given file, in
+  // microseconds, one per line as they come in.
+  Error OpenDump(const string &path);
+  // Flushes and closes the dump file. Does nothing if it was never opened.
+  Error CloseDump();
+private:
+  // A key press that's gone this long without any output probably didn't have an echo
+  // at all, so it's dropped rather than blamed on some unrelated output.
+  static constexpr std::chrono::seconds kEchoTimeout{1};
+  // How many of the most recent samples go into the histogram.
+  static constexpr size_t kRecentSamples = 256;
+
+  std::mutex m_lock;
+  // The number of key presses waiting for output, so OutputParsed doesn't need the lock
+  // when there are none.
+  std::atomic<int> m_waiting{0};
+  std::vector<clock::time_point> m_awaiting_output, m_awaiting_frame, m_drawing;
+  // The most recent samples, with m_next_sample being where the next one goes.
+  std::array<std::chrono::microseconds, kRecentSamples> m_samples;
+  size_t m_next_sample{0}, m_sample_count{0};
+  FILE *m_dump{nullptr};
+};
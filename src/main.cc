@@ -1,11 +1,41 @@
 #include "uterm.h"
+#include "trace.h"
 
 #include <absl/debugging/symbolize.h>
 #include <absl/debugging/failure_signal_handler.h>
+#include <absl/strings/string_view.h>
 
 int main(int argc, char **argv) {
   absl::InitializeSymbolizer(argv[0]);
   absl::InstallFailureSignalHandler({});
 
-  return gUterm.Run();
+  string trace_path;
+
+  for (int i = 1; i < argc; i++) {
+    absl::string_view arg{argv[i]};
+    if (arg == "--record" && i + 1 < argc) {
+      gUterm.set_record_path(argv[++i]);
+    } else if (arg == "--trace" && i + 1 < argc && kTracingBuilt) {
+      trace_path = argv[++i];
+    } else {
+      fmt::print(stderr, "usage: {} [--record FILE]{}\n", argv[0],
+                 kTracingBuilt ? " [--trace FILE]" : "");
+      return 1;
+    }
+  }
+
+  if (!trace_path.empty()) {
+    gTracer.Enable();
+    gTracer.SetThreadName("main");
+  }
+
+  int ret = gUterm.Run();
+
+  if (!trace_path.empty()) {
+    if (auto err = gTracer.Write(trace_path)) {
+      err.Extend("while saving trace").Print();
+    }
+  }
+
+  return ret;
 }
@@ -0,0 +1,138 @@
+#include "mode_scanner.h"
+
+#include <string.h>
+
+constexpr char kEsc = '\x1b';
+
+static bool ModeFromParam(uint param, ModeScanner::Mode *mode) {
+  switch (param) {
+  case 2004:
+    *mode = ModeScanner::Mode::kBracketedPaste;
+    return true;
+  case 47:
+  case 1047:
+  case 1049:
+    *mode = ModeScanner::Mode::kAltScreen;
+    return true;
+  case 2026:
+    *mode = ModeScanner::Mode::kSyncOutput;
+    return true;
+  default:
+    return false;
+  }
+}
+
+size_t ModeScanner::Scan(absl::string_view text) {
+  const char *begin = text.data(), *end = text.data() + text.size();
+
+  for (const char *p = begin; p < end; p++) {
+    if (m_state == State::kGround) {
+      // Nearly everything is plain text, so skip right over it.
+      p = static_cast<const char*>(memchr(p, kEsc, end - p));
+      if (p == nullptr) {
+        break;
+      }
+
+      m_state = State::kEscape;
+      continue;
+    }
+
+    char c = *p;
+    switch (m_state) {
+    case State::kGround:
+      break;
+    case State::kEscape:
+      if (c == '[') {
+        m_state = State::kCsi;
+      } else if (c == 'c') {
+        // RIS resets everything.
+        m_modes = 0;
+        m_state = State::kGround;
+      } else {
+        m_state = c == kEsc ? State::kEscape : State::kGround;
+      }
+      break;
+    case State::kCsi:
+      if (c == '?') {
+        m_state = State::kPrivate;
+        m_param_count = 1;
+        m_params[0] = 0;
+      } else {
+        m_state = c == kEsc ? State::kEscape : State::kGround;
+      }
+      break;
+    case State::kPrivate:
+      if (c >= '0' && c <= '9') {
+        uint &param = m_params[m_param_count - 1];
+        param = param * 10 + (c - '0');
+      } else if (c == ';') {
+        if (m_param_count < kMaxParams) {
+          m_param_count++;
+        }
+        m_params[m_param_count - 1] = 0;
+      } else if (c == 'h' || c == 'l') {
+        m_state = State::kGround;
+        if (Apply(c == 'h')) {
+          return p + 1 - begin;
+        }
+      } else if (c == '$') {
+        m_state = State::kPrivateDollar;
+      } else {
+        m_state = c == kEsc ? State::kEscape : State::kGround;
+      }
+      break;
+    case State::kPrivateDollar:
+      if (c == 'p') {
+        m_state = State::kGround;
+        if (Query()) {
+          return p + 1 - begin;
+        }
+      } else {
+        m_state = c == kEsc ? State::kEscape : State::kGround;
+      }
+      break;
+    }
+  }
+
+  return text.size();
+}
+
+bool ModeScanner::Apply(bool set) {
+  uint old_modes = m_modes;
+
+  for (int i = 0; i < m_param_count; i++) {
+    Mode mode;
+    if (!ModeFromParam(m_params[i], &mode)) {
+      continue;
+    }
+
+    if (set) {
+      m_modes |= ModeBit(mode);
+    } else {
+      m_modes &= ~ModeBit(mode);
+    }
+  }
+
+  return m_modes != old_modes;
+}
+
+bool ModeScanner::Query() {
+  Mode mode;
+  if (m_param_count != 1 || !ModeFromParam(m_params[0], &mode)) {
+    return false;
+  }
+
+  // 1 means the mode is set, 2 that it's reset.
+  m_reply = fmt::format("\x1b[?{};{}$y", m_params[0], enabled(mode) ? 1 : 2);
+  return true;
+}
+
+bool ModeScanner::TakeReply(string *reply) {
+  if (m_reply.empty()) {
+    return false;
+  }
+
+  *reply = std::move(m_reply);
+  m_reply.clear();
+  return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "base.h"
+
+#include <absl/strings/string_view.h>
+
+// A ModeScanner watches the output stream for DEC private modes that libtsm doesn't
+// track itself, i.e. CSI ? Pm h (set) and CSI ? Pm l (reset). Its state carries over
+// between calls, so a sequence split across two reads is still caught. It also answers
+// DECRQM queries (CSI ? Pm $ p) for the modes it tracks, since libtsm doesn't.
+class ModeScanner {
+public:
+  enum class Mode { kBracketedPaste, kAltScreen, kSyncOutput };
+
+  bool enabled(Mode mode) const { return m_modes & ModeBit(mode); }
+
+  // Scans text up to and including the first sequence that changes or queries a tracked
+  // mode, and returns how much of it was scanned. If there's no such sequence, the whole
+  // text is scanned. This lets the caller act on a mode change at the exact point in the
+  // stream where it happened.
+  size_t Scan(absl::string_view text);
+  // If the last Scan stopped at a query, moves the reply to send back into reply and
+  // returns true.
+  bool TakeReply(string *reply);
+private:
+  static constexpr uint ModeBit(Mode mode) { return 1 << static_cast<int>(mode); }
+  // Returns true if the mode changed.
+  bool Apply(bool set);
+  // Returns true if the mode being queried is a tracked one.
+  bool Query();
+
+  enum class State { kGround, kEscape, kCsi, kPrivate, kPrivateDollar };
+  State m_state{State::kGround};
+
+  // The parameters of the sequence being scanned. Only the last few matter.
+  static constexpr int kMaxParams = 8;
+  uint m_params[kMaxParams];
+  int m_param_count{0};
+
+  uint m_modes{0};
+  string m_reply;
+};
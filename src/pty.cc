@@ -3,7 +3,10 @@
 #include <absl/strings/str_join.h>
 #include <absl/strings/str_split.h>
 
+#include <algorithm>
+
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <signal.h>
@@ -121,58 +124,154 @@ Error Pty::Spawn(const std::vector<string>& command) {
   } else {
     // Master side.
     close(w_slave.Relinquish());
+
+    // Never block: reads are always preceded by a poll, so a reader can drain everything
+    // that's available without polling in between, and writes are queued up and flushed
+    // whenever the child makes room for them, so a stuck child can't freeze us.
+    int flags = fcntl(master, F_GETFL);
+    if (flags == -1 || fcntl(master, F_SETFL, flags | O_NONBLOCK) == -1) {
+      return Error::Errno().Extend("making master PTY non-blocking");
+    }
+
     m_master = w_master.Relinquish();
     m_pid = pid;
     return Error::New();
   }
 }
 
-Expect<string> Pty::Read(bool *eof) {
+bool Pty::ChildExited() {
   pid_t child_status = waitpid(m_pid, nullptr, WNOHANG);
-  if (child_status == m_pid || (child_status == -1 && errno == ECHILD)) {
-    *eof = true;
-    return Expect<string>::New(string(""));
-  }
+  // If someone else (e.g. a SIGCHLD handler) already reaped it, we get ECHILD instead.
+  return child_status == m_pid || (child_status == -1 && errno == ECHILD);
+}
+
+Error Pty::Poll(int timeout, bool *readable, bool *interrupted) {
+  *readable = *interrupted = false;
 
   pollfd poll_master;
   poll_master.fd = m_master;
   poll_master.events = POLLIN;
   poll_master.revents = 0;
 
-  fflush(stdout);
-  int polled = poll(&poll_master, 1, -1);
+  if (has_pending_writes()) {
+    poll_master.events |= POLLOUT;
+  }
+
+  int polled = poll(&poll_master, 1, timeout);
   if (polled == -1) {
     if (errno == EINTR) {
-      return Expect<string>::New(string(""));
+      *interrupted = true;
+      return Error::New();
     } else {
-      return Expect<string>::New(Error::Errno().Extend("polling master PTY"));
+      return Error::Errno().Extend("polling master PTY");
     }
-  } else if (poll_master.revents & POLLIN) {
-    fflush(stdout);
-    char buf[4096];
-    int sz = read(m_master, buf, sizeof(buf));
+  }
 
-    if (sz == -1) {
-      return Expect<string>::New(Error::Errno().Extend("reading master PTY"));
+  if (polled != 0 && poll_master.revents & POLLOUT) {
+    if (auto err = Flush()) {
+      return err;
     }
+  }
+
+  // A hangup is reported as readable too, so the following Read will see the EOF.
+  *readable = polled != 0 &&
+              (poll_master.revents & (POLLIN | POLLERR | POLLHUP)) != 0;
+  return Error::New();
+}
+
+Error Pty::Read(absl::Span<char> buffer, size_t *nread, bool *eof) {
+  iovec iov;
+  iov.iov_base = buffer.data();
+  iov.iov_len = buffer.size();
+  return Read(&iov, 1, nread, eof);
+}
 
-    return Expect<string>::New(string(buf, sz));
-  } else if (poll_master.revents & (POLLERR | POLLHUP)) {
+Error Pty::Read(const iovec *iov, int iovcnt, size_t *nread, bool *eof) {
+  *nread = 0;
+
+  ssize_t sz = readv(m_master, iov, iovcnt);
+  if (sz == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return Error::New();
+    } else if (errno == EIO) {
+      // This is what Linux gives once the slave side has been closed.
+      *eof = true;
+      return Error::New();
+    } else {
+      return Error::Errno().Extend("reading master PTY");
+    }
+  } else if (sz == 0) {
     *eof = true;
-    return Expect<string>::New(string(""));
-  } else {
-    return Expect<string>::WithError("unknown error occurred in NonblockingRead");
   }
+
+  *nread = sz;
+
+  if (m_recorder != nullptr) {
+    size_t remaining = sz;
+    for (int i = 0; i < iovcnt && remaining != 0; i++) {
+      size_t len = std::min(remaining, iov[i].iov_len);
+      auto data = static_cast<const char*>(iov[i].iov_base);
+      m_recorder->RecordOutput(absl::string_view{data, len});
+      remaining -= len;
+    }
+  }
+
+  return Error::New();
 }
 
-Error Pty::Write(const string& data) {
-  if (write(m_master, static_cast<const void*>(data.c_str()), data.size()) == -1) {
-    return Error::Errno().Extend("writing to master PTY");
+void Pty::Write(absl::string_view data) {
+  if (m_recorder != nullptr) {
+    m_recorder->RecordInput(data);
   }
 
+  std::unique_lock<std::mutex> lock{m_write_lock};
+  m_outbound.append(data.data(), data.size());
+}
+
+Error Pty::Flush(bool *backed_up) {
+  std::unique_lock<std::mutex> lock{m_write_lock};
+
+  size_t pending = m_outbound.size() - m_outbound_offset;
+  if (pending == 0) {
+    m_backed_up = false;
+    return Error::New();
+  }
+
+  ssize_t sz = write(m_master, m_outbound.data() + m_outbound_offset, pending);
+  if (sz == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      // Nobody's going to read the rest of it anyway.
+      m_outbound.clear();
+      m_outbound_offset = 0;
+      m_backed_up = false;
+      return Error::Errno().Extend("writing to master PTY");
+    }
+  } else {
+    m_outbound_offset += sz;
+    if (m_outbound_offset == m_outbound.size()) {
+      m_outbound.clear();
+      m_outbound_offset = 0;
+    } else if (m_outbound_offset > m_outbound.size() / 2) {
+      // Don't let a slow child make every partial write shift the whole queue down.
+      m_outbound.erase(0, m_outbound_offset);
+      m_outbound_offset = 0;
+    }
+  }
+
+  bool now_backed_up = m_outbound_offset != m_outbound.size();
+  if (now_backed_up && !m_backed_up && backed_up != nullptr) {
+    *backed_up = true;
+  }
+  m_backed_up = now_backed_up;
+
   return Error::New();
 }
 
+bool Pty::has_pending_writes() {
+  std::unique_lock<std::mutex> lock{m_write_lock};
+  return m_outbound_offset != m_outbound.size();
+}
+
 Error Pty::Signal(int signal) {
   if (m_pid == -1) {
     return Error::New("cannot Signal Pty without process");
@@ -194,6 +293,10 @@ Error Pty::Resize(int x, int y) {
   if (ioctl(m_master, TIOCSWINSZ, &ws) == -1) {
     return Error::Errno().Extend("resizing pty terminal");
   } else {
+    if (m_recorder != nullptr) {
+      m_recorder->RecordResize(x, y);
+    }
+
     return Error::New();
   }
 }
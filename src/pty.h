@@ -2,20 +2,53 @@
 
 #include "base.h"
 #include "error.h"
+#include "recorder.h"
+
+#include <absl/strings/string_view.h>
+#include <absl/types/span.h>
+
+#include <mutex>
+
+#include <sys/uio.h>
 
 // A Pty represents a currently active pty (surprise, surprise).
 class Pty {
 public:
   ~Pty();
 
+  // The master end of the pty, for watching with poll or epoll.
+  int fd() const { return m_master; }
+  int pid() const { return m_pid; }
+  // Everything read, written, or resized from now on will also be recorded here.
+  void set_recorder(Recorder *recorder) { m_recorder = recorder; }
+
   // Spawn the given command within this pty.
   Error Spawn(const std::vector<string>& command);
 
-  // Performs a blocking read from the pty output. If an EOF occurs, returns an empty
-  // string.
-  Expect<string> Read(bool *eof);
-  // Performs a blocking write
-  Error Write(const string& data);
+  // Reaps the child process if it has exited, and returns whether it has. This isn't
+  // checked by Read, so callers should check it whenever they think the child may have
+  // exited (e.g. after a SIGCHLD).
+  bool ChildExited();
+
+  // Waits up to timeout milliseconds (or forever if -1) for the pty to have output or
+  // hang up. If interrupted by a signal, returns with *readable unset and *interrupted
+  // set. While there are queued writes, this also waits for the pty to be writable and
+  // then flushes them, in which case it may return with both unset.
+  Error Poll(int timeout, bool *readable, bool *interrupted);
+  // Reads whatever output is immediately available into the caller's buffer(s), without
+  // blocking, and stores how much was read in *nread (0 if nothing was available). If an
+  // EOF occurs, sets *eof.
+  Error Read(absl::Span<char> buffer, size_t *nread, bool *eof);
+  Error Read(const iovec *iov, int iovcnt, size_t *nread, bool *eof);
+  // Queues data to be written to the pty by the next Flush. Safe to call from any thread.
+  void Write(absl::string_view data);
+  // Writes as much of the queued data as the pty will take right now, in a single
+  // syscall, without blocking. Whatever doesn't fit stays queued for the next Flush. If
+  // this is what left data queued, i.e. nothing was still queued after the last Flush,
+  // sets *backed_up, so the caller can get whoever polls the pty to wait on it.
+  Error Flush(bool *backed_up = nullptr);
+  // Whether there's queued data left, i.e. whether to wait for the pty to be writable.
+  bool has_pending_writes();
   // Sends the given signal to the pty.
   Error Signal(int signal);
   // Resizes the given pty to the number of columns and rows.
@@ -25,4 +58,12 @@ private:
   int m_master{-1};
   // The child process's PID.
   int m_pid{-1};
+  Recorder *m_recorder{nullptr};
+
+  // Guards the outbound queue. Data before m_outbound_offset has already been written.
+  std::mutex m_write_lock;
+  string m_outbound;
+  size_t m_outbound_offset{0};
+  // Whether the last Flush left data queued.
+  bool m_backed_up{false};
 };
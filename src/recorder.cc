@@ -0,0 +1,169 @@
+#include "recorder.h"
+
+constexpr absl::string_view kMagic{"utermrec1\n"};
+// Nothing legitimate comes close to this; it just stops a corrupt file from making us
+// allocate all the memory there is.
+constexpr uint64 kMaxEventSize = 64 << 20;
+
+static void AppendVarint(string *out, uint64 value) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Returns false on EOF or if the varint is too long.
+static bool ReadVarint(FILE *file, uint64 *value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = getc(file);
+    if (c == EOF) {
+      return false;
+    }
+
+    *value |= static_cast<uint64>(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool ReadVarint(absl::string_view *data, uint64 *value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && !data->empty(); shift += 7) {
+    uint8_t c = data->front();
+    data->remove_prefix(1);
+
+    *value |= static_cast<uint64>(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+Recorder::~Recorder() {
+  if (auto err = Close()) {
+    err.Print();
+  }
+}
+
+Error Recorder::Open(const string &path) {
+  std::unique_lock<std::mutex> lock{m_lock};
+
+  m_file = fopen(path.c_str(), "wbe");
+  if (m_file == nullptr) {
+    return Error::Errno().Extend(fmt::format("opening {}", path));
+  }
+
+  fwrite(kMagic.data(), 1, kMagic.size(), m_file);
+  m_last = std::chrono::steady_clock::now();
+  return Error::New();
+}
+
+Error Recorder::Close() {
+  std::unique_lock<std::mutex> lock{m_lock};
+
+  if (m_file == nullptr) {
+    return Error::New();
+  }
+
+  bool failed = ferror(m_file);
+  failed = fclose(m_file) != 0 || failed;
+  m_file = nullptr;
+
+  if (failed) {
+    return Error::New("failed to write recording");
+  }
+  return Error::New();
+}
+
+void Recorder::RecordResize(int cols, int rows) {
+  string data;
+  AppendVarint(&data, cols);
+  AppendVarint(&data, rows);
+  Record(RecordKind::kResize, data);
+}
+
+void Recorder::Record(RecordKind kind, absl::string_view data) {
+  std::unique_lock<std::mutex> lock{m_lock};
+
+  if (m_file == nullptr) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  auto delay = std::chrono::duration_cast<std::chrono::microseconds>(now - m_last);
+  m_last = now;
+
+  // Errors are only checked for once the file is closed.
+  string header;
+  header.push_back(static_cast<char>(kind));
+  AppendVarint(&header, delay.count());
+  AppendVarint(&header, data.size());
+
+  fwrite(header.data(), 1, header.size(), m_file);
+  fwrite(data.data(), 1, data.size(), m_file);
+}
+
+Playback::~Playback() {
+  if (m_file != nullptr) {
+    fclose(m_file);
+  }
+}
+
+Error Playback::Open(const string &path) {
+  m_file = fopen(path.c_str(), "rbe");
+  if (m_file == nullptr) {
+    return Error::Errno().Extend(fmt::format("opening {}", path));
+  }
+
+  string magic(kMagic.size(), '\0');
+  if (fread(&magic[0], 1, magic.size(), m_file) != magic.size() || magic != kMagic) {
+    return Error::New(fmt::format("{} is not a uterm recording", path));
+  }
+
+  return Error::New();
+}
+
+Error Playback::Next(Event *event, bool *eof) {
+  int kind = getc(m_file);
+  if (kind == EOF) {
+    *eof = true;
+    return ferror(m_file) ? Error::Errno().Extend("reading recording") : Error::New();
+  } else if (kind > static_cast<int>(RecordKind::kResize)) {
+    return Error::New(fmt::format("unknown event kind {}", kind));
+  }
+
+  uint64 delay, size;
+  if (!ReadVarint(m_file, &delay) || !ReadVarint(m_file, &size)) {
+    return Error::New("truncated event header");
+  } else if (size > kMaxEventSize) {
+    return Error::New(fmt::format("event is too large ({} bytes)", size));
+  }
+
+  event->kind = static_cast<RecordKind>(kind);
+  event->delay = std::chrono::microseconds{delay};
+  event->data.resize(size);
+  if (fread(&event->data[0], 1, size, m_file) != size) {
+    return Error::New("truncated event data");
+  }
+
+  if (event->kind == RecordKind::kResize) {
+    absl::string_view data{event->data};
+    uint64 cols, rows;
+    if (!ReadVarint(&data, &cols) || !ReadVarint(&data, &rows)) {
+      return Error::New("invalid resize event");
+    }
+
+    event->cols = cols;
+    event->rows = rows;
+    event->data.clear();
+  }
+
+  return Error::New();
+}
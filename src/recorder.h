@@ -0,0 +1,61 @@
+#pragma once
+
+#include "base.h"
+#include "error.h"
+
+#include <absl/strings/string_view.h>
+
+#include <chrono>
+#include <mutex>
+
+#include <stdio.h>
+
+// A recording is a short header followed by one record per event:
+//
+//   kind (1 byte) | delay (varint) | size (varint) | data (size bytes)
+//
+// where the delay is the time since the previous event in microseconds. A resize stores
+// the new columns and rows as two varints in its data.
+enum class RecordKind : uint8_t { kOutput, kInput, kResize };
+
+// A Recorder saves everything that goes through a pty to a file, so the session can be
+// replayed later without the child. Safe to use from any thread.
+class Recorder {
+public:
+  ~Recorder();
+
+  Error Open(const string &path);
+  // Flushes and closes the file. Does nothing if it was never opened.
+  Error Close();
+
+  void RecordOutput(absl::string_view data) { Record(RecordKind::kOutput, data); }
+  void RecordInput(absl::string_view data) { Record(RecordKind::kInput, data); }
+  void RecordResize(int cols, int rows);
+private:
+  void Record(RecordKind kind, absl::string_view data);
+
+  std::mutex m_lock;
+  FILE *m_file{nullptr};
+  std::chrono::steady_clock::time_point m_last;
+};
+
+// A Playback reads back the events saved by a Recorder.
+class Playback {
+public:
+  struct Event {
+    RecordKind kind;
+    std::chrono::microseconds delay;
+    // Only set for output and input.
+    string data;
+    // Only set for resizes.
+    int cols, rows;
+  };
+
+  ~Playback();
+
+  Error Open(const string &path);
+  // Reads the next event into *event, or sets *eof if there are none left.
+  Error Next(Event *event, bool *eof);
+private:
+  FILE *m_file{nullptr};
+};
@@ -0,0 +1,55 @@
+#include "ring_buffer.h"
+
+#include <algorithm>
+#include <cstdint>
+
+static size_t RoundUpToPowerOfTwo(size_t n) {
+  constexpr size_t kHighestPowerOfTwo = ~(SIZE_MAX >> 1);
+  if (n > kHighestPowerOfTwo) {
+    return kHighestPowerOfTwo;
+  }
+
+  size_t result = 1;
+  while (result < n) {
+    result <<= 1;
+  }
+  return result;
+}
+
+ByteRing::ByteRing(size_t capacity): m_capacity{RoundUpToPowerOfTwo(capacity)},
+                                     m_mask{m_capacity - 1},
+                                     m_data{new char[m_capacity]} {}
+
+absl::Span<char> ByteRing::WritableSpan() {
+  size_t free = m_capacity - size();
+  size_t offset = m_write_pos & m_mask;
+  return {m_data.get() + offset, std::min(free, m_capacity - offset)};
+}
+
+void ByteRing::WritableSpans(absl::Span<char> *first, absl::Span<char> *second) {
+  size_t free = m_capacity - size();
+  size_t offset = m_write_pos & m_mask;
+  size_t first_size = std::min(free, m_capacity - offset);
+
+  *first = {m_data.get() + offset, first_size};
+  *second = {m_data.get(), free - first_size};
+}
+
+void ByteRing::Commit(size_t n) {
+  m_write_pos += n;
+  m_high_water = std::max(m_high_water, size());
+}
+
+absl::Span<const char> ByteRing::ReadableSpan() {
+  size_t offset = m_read_pos & m_mask;
+  return {m_data.get() + offset, std::min(size(), m_capacity - offset)};
+}
+
+void ByteRing::Consume(size_t n) {
+  m_read_pos += n;
+  // Since it's always drained right after being filled, starting over from the beginning
+  // means the next read never has to be split across the end.
+  if (m_read_pos == m_write_pos) {
+    m_read_pos = m_write_pos = 0;
+  }
+}
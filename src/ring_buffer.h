@@ -0,0 +1,45 @@
+#pragma once
+
+#include "base.h"
+
+#include <absl/types/span.h>
+
+#include <memory>
+
+// A ByteRing is a fixed-capacity ring of bytes that pty output is read into and then fed
+// to the terminal from, without copying it anywhere in between. Both ends are used by the
+// same thread (the reader thread, or the event loop), which drains it right after each
+// read, so it's just a reusable buffer: nothing here is synchronized.
+class ByteRing {
+public:
+  // The capacity is rounded up to the next power of two.
+  ByteRing(size_t capacity);
+
+  size_t capacity() const { return m_capacity; }
+  // The number of bytes currently readable.
+  size_t size() const { return m_write_pos - m_read_pos; }
+  // The most bytes that have ever been waiting in the ring at once.
+  size_t high_water() const { return m_high_water; }
+
+  // Returns the contiguous free space after the write position. This may be shorter than
+  // the total free space if it wraps around the end.
+  absl::Span<char> WritableSpan();
+  // Like WritableSpan, but if the free space wraps around the end, the part at the
+  // beginning is stored in *second (otherwise *second is empty).
+  void WritableSpans(absl::Span<char> *first, absl::Span<char> *second);
+  // Marks the next n bytes of free space as readable.
+  void Commit(size_t n);
+
+  // Returns the contiguous readable bytes after the read position.
+  absl::Span<const char> ReadableSpan();
+  // Releases the first n bytes of the last ReadableSpan.
+  void Consume(size_t n);
+private:
+  size_t m_capacity, m_mask;
+  std::unique_ptr<char[]> m_data;
+
+  // Both positions only ever increase, until the ring is emptied; they're masked when
+  // indexing into m_data.
+  size_t m_write_pos{0}, m_read_pos{0};
+  size_t m_high_water{0};
+};
@@ -0,0 +1,440 @@
+#include "scrollback.h"
+#include "search.h"
+
+#include <utf8.h>
+
+#include <algorithm>
+#include <bitset>
+#include <iterator>
+#include <limits>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct Scrollback::Chunk {
+  // Where each line's text and runs start. A line ends where the next one starts.
+  struct Line { uint32 text, runs; };
+  // A run of characters that all have the same attributes and width.
+  struct Run {
+    tsm_screen_attr attr;
+    uint16_t chars;
+    uint8_t width;
+  };
+
+  std::vector<Line> lines;
+  std::vector<Run> runs;
+  string text;
+
+  // A rough index of the text, so Find can skip chunks that can't have a match without
+  // touching (or mapping back in) their text: every byte in it, and a hash of every pair
+  // of adjacent bytes. It stays in memory even once the chunk is spilled.
+  static constexpr size_t kPairBits = 4096;
+  std::bitset<256> bytes;
+  std::bitset<kPairBits> pairs;
+
+  static size_t PairBit(unsigned char a, unsigned char b) {
+    return (a * 31u + b * 131u) % kPairBits;
+  }
+
+  void Index(absl::string_view appended, char before);
+  bool MayContain(absl::string_view needle) const;
+
+  // Where the chunk was written in the spill file, if it was. The vectors above are
+  // empty then.
+  bool spilled{false};
+  uint64 offset{0};
+  size_t size{0};
+};
+
+// A spilled chunk is written out as this header, followed by its lines, runs, and text.
+// Chunks start on a multiple of kSpillAlignment, so they can be used in place once
+// they're mapped back in.
+struct SpillHeader {
+  uint32 lines, runs, text, reserved;
+};
+
+constexpr size_t kSpillAlignment = 16;
+
+struct Scrollback::ChunkView {
+  const Chunk::Line *lines;
+  size_t line_count;
+  const Chunk::Run *runs;
+  size_t run_count;
+  const char *text;
+  size_t text_size;
+};
+
+constexpr size_t Scrollback::Chunk::kPairBits;
+
+void Scrollback::Chunk::Index(absl::string_view appended, char before) {
+  unsigned char last = before;
+  for (unsigned char c : appended) {
+    bytes.set(c);
+    pairs.set(PairBit(last, c));
+    last = c;
+  }
+}
+
+bool Scrollback::Chunk::MayContain(absl::string_view needle) const {
+  for (size_t i = 0; i < needle.size(); i++) {
+    if (!bytes.test(static_cast<unsigned char>(needle[i])) ||
+        (i != 0 && !pairs.test(PairBit(needle[i - 1], needle[i])))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+constexpr size_t Scrollback::kChunkLines;
+constexpr size_t Scrollback::kHotChunks;
+constexpr size_t Scrollback::kMaxMappings;
+
+Scrollback::Scrollback() {}
+
+Scrollback::~Scrollback() {
+  for (auto &mapping : m_mappings) {
+    munmap(mapping.base, mapping.length);
+  }
+
+  if (m_spill_fd != -1) {
+    close(m_spill_fd);
+  }
+}
+
+void Scrollback::set_max_lines(size_t max_lines) {
+  m_max_lines = max_lines;
+  while (m_size > m_max_lines) {
+    DropOldest();
+  }
+}
+
+size_t Scrollback::memory_usage() const {
+  size_t total = 0;
+  for (auto &chunk : m_chunks) {
+    total += sizeof(Chunk) + chunk->lines.capacity() * sizeof(Chunk::Line) +
+             chunk->runs.capacity() * sizeof(Chunk::Run) + chunk->text.capacity();
+  }
+  return total;
+}
+
+Error Scrollback::EnableSpilling(const string &dir) {
+  // The file is never linked into the directory at all if the filesystem supports it, and
+  // unlinked right away otherwise, so it's gone as soon as we are.
+  int fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    string path = dir + "/uterm-scrollback-XXXXXX";
+    fd = mkostemp(&path[0], O_CLOEXEC);
+    if (fd == -1) {
+      return Error::Errno().Extend(fmt::format("creating a file in {}", dir));
+    }
+    unlink(path.c_str());
+  }
+
+  m_spill_fd = fd;
+
+  // Everything but the newest chunks (the last of which is still being filled) can go.
+  for (size_t i = 0; i + kHotChunks + 1 < m_chunks.size(); i++) {
+    Spill(m_chunks[i].get());
+  }
+
+  return Error::New();
+}
+
+void Scrollback::Push(absl::Span<const ScrollbackCell> cells) {
+  if (m_max_lines == 0) {
+    return;
+  } else if (m_size == m_max_lines) {
+    DropOldest();
+  }
+
+  if (m_chunks.empty() || m_chunks.back()->lines.size() == kChunkLines) {
+    if (!m_chunks.empty()) {
+      // Nothing more will be added to the last chunk, so don't waste its spare capacity.
+      Chunk &full = *m_chunks.back();
+      full.runs.shrink_to_fit();
+      full.text.shrink_to_fit();
+    }
+
+    m_chunks.emplace_back(new Chunk);
+    m_chunks.back()->lines.reserve(kChunkLines);
+
+    if (m_chunks.size() > kHotChunks + 1) {
+      Spill(m_chunks[m_chunks.size() - kHotChunks - 2].get());
+    }
+  }
+
+  Chunk &chunk = *m_chunks.back();
+  size_t first_run = chunk.runs.size(), first_byte = chunk.text.size();
+  chunk.lines.push_back({static_cast<uint32>(chunk.text.size()),
+                         static_cast<uint32>(first_run)});
+
+  size_t end = cells.size();
+  while (end != 0 && (cells[end - 1].ch == 0 || cells[end - 1].ch == ' ') &&
+         SameTsmAttr(cells[end - 1].attr, m_blank)) {
+    end--;
+  }
+
+  for (size_t i = 0; i < end; i++) {
+    const auto &cell = cells[i];
+
+    if (chunk.runs.size() == first_run || chunk.runs.back().width != cell.width ||
+        chunk.runs.back().chars == std::numeric_limits<uint16_t>::max() ||
+        !SameTsmAttr(chunk.runs.back().attr, cell.attr)) {
+      chunk.runs.push_back({cell.attr, 0, static_cast<uint8_t>(cell.width)});
+    }
+
+    chunk.runs.back().chars++;
+    utf8::unchecked::append(cell.ch != 0 ? cell.ch : ' ', std::back_inserter(chunk.text));
+  }
+
+  chunk.Index(absl::string_view{chunk.text}.substr(first_byte),
+              first_byte != 0 ? chunk.text[first_byte - 1] : '\0');
+
+  m_size++;
+  m_pushed++;
+}
+
+void Scrollback::Expand(size_t index, std::vector<ScrollbackCell> *cells) {
+  cells->clear();
+
+  size_t line = m_first + index;
+  ChunkView chunk;
+  if (!View(*m_chunks[line / kChunkLines], &chunk)) {
+    return;
+  }
+
+  size_t i = line % kChunkLines;
+  bool last = i + 1 == chunk.line_count;
+  size_t runs_end = last ? chunk.run_count : chunk.lines[i + 1].runs;
+
+  const char *p = chunk.text + chunk.lines[i].text;
+  for (size_t r = chunk.lines[i].runs; r < runs_end; r++) {
+    const auto &run = chunk.runs[r];
+    for (int c = 0; c < run.chars; c++) {
+      cells->push_back({utf8::unchecked::next(p), run.width, run.attr});
+    }
+  }
+}
+
+void Scrollback::Find(absl::string_view needle, size_t begin, size_t end,
+                      const FoundCb &found) {
+  while (begin < end) {
+    size_t line = m_first + begin;
+    const Chunk &indexed = *m_chunks[line / kChunkLines];
+    if (!indexed.MayContain(needle)) {
+      // Every chunk but the last is full, and end is never past the last.
+      begin += std::min(kChunkLines - line % kChunkLines, end - begin);
+      continue;
+    }
+
+    ChunkView chunk;
+    if (!View(indexed, &chunk)) {
+      return;
+    }
+
+    // Search through every wanted line in this chunk in one go.
+    size_t first = line % kChunkLines;
+    size_t last = std::min(first + (end - begin), chunk.line_count);
+    auto line_end = [&](size_t i) {
+      return i + 1 < chunk.line_count ? chunk.lines[i + 1].text : chunk.text_size;
+    };
+
+    size_t text_begin = chunk.lines[first].text, text_end = line_end(last - 1);
+    absl::string_view text{chunk.text + text_begin, text_end - text_begin};
+
+    for (size_t pos = 0; ; ) {
+      size_t match = FindSubstring(text.substr(pos), needle);
+      if (match == absl::string_view::npos) {
+        break;
+      }
+      match += pos;
+
+      size_t offset = text_begin + match;
+      auto it = std::upper_bound(chunk.lines + first, chunk.lines + last, offset,
+                                 [](size_t offset, const Chunk::Line &line) {
+                                   return offset < line.text;
+                                 });
+      size_t i = it - chunk.lines - 1;
+
+      if (offset + needle.size() > line_end(i)) {
+        // It runs onto the next line.
+        pos = match + 1;
+        continue;
+      }
+
+      // Walk the line's runs up to the match to find out which cells it's in.
+      const char *p = chunk.text + chunk.lines[i].text;
+      const char *match_begin = chunk.text + offset;
+      const char *match_end = match_begin + needle.size();
+      uint x = 0, width = 0;
+      bool last_line = i + 1 == chunk.line_count;
+      size_t runs_end = last_line ? chunk.run_count : chunk.lines[i + 1].runs;
+      for (size_t r = chunk.lines[i].runs; r < runs_end && p < match_end; r++) {
+        const auto &run = chunk.runs[r];
+        for (int c = 0; c < run.chars && p < match_end; c++) {
+          if (p < match_begin) {
+            x += run.width;
+          } else {
+            width += run.width;
+          }
+          utf8::unchecked::next(p);
+        }
+      }
+
+      found(begin + (i - first), x, width);
+      pos = match + needle.size();
+    }
+
+    begin += last - first;
+  }
+}
+
+void Scrollback::Clear() {
+  for (auto &chunk : m_chunks) {
+    Release(*chunk);
+  }
+
+  m_chunks.clear();
+  m_first = m_size = 0;
+
+  if (m_spill_fd != -1 && ftruncate(m_spill_fd, 0) == 0) {
+    m_spill_end = 0;
+  }
+}
+
+void Scrollback::DropOldest() {
+  m_size--;
+  if (++m_first == kChunkLines) {
+    Release(*m_chunks.front());
+    m_chunks.pop_front();
+    m_first = 0;
+  }
+}
+
+void Scrollback::Spill(Chunk *chunk) {
+  if (m_spill_fd == -1 || m_spill_failed || chunk->spilled) {
+    return;
+  }
+
+  SpillHeader header{static_cast<uint32>(chunk->lines.size()),
+                     static_cast<uint32>(chunk->runs.size()),
+                     static_cast<uint32>(chunk->text.size()), 0};
+
+  string data;
+  data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  data.append(reinterpret_cast<const char*>(chunk->lines.data()),
+              chunk->lines.size() * sizeof(Chunk::Line));
+  data.append(reinterpret_cast<const char*>(chunk->runs.data()),
+              chunk->runs.size() * sizeof(Chunk::Run));
+  data.append(chunk->text);
+  data.resize((data.size() + kSpillAlignment - 1) / kSpillAlignment * kSpillAlignment);
+
+  for (size_t written = 0; written < data.size(); ) {
+    ssize_t ret = pwrite(m_spill_fd, data.data() + written, data.size() - written,
+                         m_spill_end + written);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    } else if (ret == -1) {
+      Error::Errno().Extend("spilling scrollback; keeping the rest in memory").Print();
+      m_spill_failed = true;
+      return;
+    }
+
+    written += ret;
+  }
+
+  chunk->spilled = true;
+  chunk->offset = m_spill_end;
+  chunk->size = data.size();
+  m_spill_end += data.size();
+  m_spilled += data.size();
+
+  std::vector<Chunk::Line>().swap(chunk->lines);
+  std::vector<Chunk::Run>().swap(chunk->runs);
+  string().swap(chunk->text);
+}
+
+void Scrollback::Release(const Chunk &chunk) {
+  if (!chunk.spilled) {
+    return;
+  }
+
+  Unmap(chunk.offset);
+  // Don't let the file keep growing forever. If the filesystem can't punch holes, the
+  // space is only reclaimed once the file is closed.
+  fallocate(m_spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, chunk.offset,
+            chunk.size);
+  m_spilled -= chunk.size;
+}
+
+const char * Scrollback::Map(uint64 offset, size_t size) {
+  for (auto &mapping : m_mappings) {
+    if (mapping.offset == offset) {
+      mapping.last_used = ++m_map_clock;
+      return mapping.data;
+    }
+  }
+
+  if (m_mappings.size() == kMaxMappings) {
+    auto lru = std::min_element(m_mappings.begin(), m_mappings.end(),
+                                [](const Mapping &a, const Mapping &b) {
+                                  return a.last_used < b.last_used;
+                                });
+    Unmap(lru->offset);
+  }
+
+  static const uint64 page_size = sysconf(_SC_PAGESIZE);
+  uint64 start = offset / page_size * page_size;
+  size_t length = offset + size - start;
+
+  void *base = mmap(nullptr, length, PROT_READ, MAP_SHARED, m_spill_fd, start);
+  if (base == MAP_FAILED) {
+    Error::Errno().Extend("mapping in spilled scrollback").Print();
+    return nullptr;
+  }
+
+  const char *data = static_cast<const char*>(base) + (offset - start);
+  m_mappings.push_back({offset, base, length, data, ++m_map_clock});
+  return data;
+}
+
+void Scrollback::Unmap(uint64 offset) {
+  for (auto it = m_mappings.begin(); it != m_mappings.end(); ++it) {
+    if (it->offset == offset) {
+      munmap(it->base, it->length);
+      m_mappings.erase(it);
+      return;
+    }
+  }
+}
+
+bool Scrollback::View(const Chunk &chunk, ChunkView *view) {
+  if (!chunk.spilled) {
+    *view = {chunk.lines.data(), chunk.lines.size(), chunk.runs.data(), chunk.runs.size(),
+             chunk.text.data(), chunk.text.size()};
+    return true;
+  }
+
+  const char *data = Map(chunk.offset, chunk.size);
+  if (data == nullptr) {
+    return false;
+  }
+
+  SpillHeader header;
+  memcpy(&header, data, sizeof(header));
+  data += sizeof(header);
+
+  view->lines = reinterpret_cast<const Chunk::Line*>(data);
+  view->line_count = header.lines;
+  data += header.lines * sizeof(Chunk::Line);
+  view->runs = reinterpret_cast<const Chunk::Run*>(data);
+  view->run_count = header.runs;
+  data += header.runs * sizeof(Chunk::Run);
+  view->text = data;
+  view->text_size = header.text;
+  return true;
+}
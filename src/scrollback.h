@@ -0,0 +1,123 @@
+#pragma once
+
+#include "base.h"
+#include "error.h"
+
+#include <absl/strings/string_view.h>
+#include <absl/types/span.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <libtsm.h>
+
+inline bool SameTsmAttr(const tsm_screen_attr &a, const tsm_screen_attr &b) {
+  return a.fccode == b.fccode && a.bccode == b.bccode &&
+         a.fr == b.fr && a.fg == b.fg && a.fb == b.fb &&
+         a.br == b.br && a.bg == b.bg && a.bb == b.bb &&
+         a.bold == b.bold && a.italic == b.italic && a.underline == b.underline &&
+         a.inverse == b.inverse && a.protect == b.protect && a.blink == b.blink;
+}
+
+// One cell of a line going into or coming out of the scrollback. A wide character takes
+// up width cells; the cells it covers aren't included separately.
+struct ScrollbackCell {
+  uint32 ch;
+  uint width;
+  tsm_screen_attr attr;
+};
+
+// A Scrollback holds the lines that have scrolled off the top of the screen. Instead of
+// a full row of cells, each line is kept as its UTF-8 text plus the runs of attributes
+// over it, minus any trailing blanks, so a line costs about as much as its text does.
+// Lines are packed into chunks of kChunkLines, and the oldest ones are dropped once there
+// are more than max_lines.
+//
+// Once spilling is enabled, all but the newest few chunks are written out to an unlinked
+// file and freed, leaving just their place in the file behind. They're mapped back in on
+// demand, a few at a time, so memory use stays bounded however many lines are kept.
+class Scrollback {
+public:
+  static constexpr size_t kChunkLines = 1024;
+
+  Scrollback();
+  ~Scrollback();
+
+  size_t size() const { return m_size; }
+  size_t max_lines() const { return m_max_lines; }
+  void set_max_lines(size_t max_lines);
+  // Trailing blanks that have this attribute are left out of each line.
+  void set_blank_attr(const tsm_screen_attr &attr) { m_blank = attr; }
+
+  // How many lines have been pushed in total, including any that have been dropped
+  // since. The line at index i was the (pushed() - size() + i)th one pushed, which never
+  // changes, unlike its index.
+  uint64 pushed() const { return m_pushed; }
+  // The number of bytes taken up by the stored lines in memory, and on disk.
+  size_t memory_usage() const;
+  uint64 spilled_bytes() const { return m_spilled; }
+
+  // Starts spilling old chunks to a file in the given directory.
+  Error EnableSpilling(const string &dir);
+
+  // Adds a line after the newest one, dropping the oldest one if it's full.
+  void Push(absl::Span<const ScrollbackCell> cells);
+  // Expands the line at the given index (0 being the oldest) back into cells. Anything
+  // after the last non-blank cell isn't included. If the line was spilled, its chunk is
+  // mapped back in.
+  void Expand(size_t index, std::vector<ScrollbackCell> *cells);
+
+  // Called with the index of the line a match is on, the cell it starts at, and how many
+  // cells it covers.
+  using FoundCb = std::function<void(size_t index, uint x, uint width)>;
+  // Finds every occurrence of the given UTF-8 text in the lines from begin up to end, in
+  // order. Matches can't span more than one line.
+  void Find(absl::string_view needle, size_t begin, size_t end, const FoundCb &found);
+  void Clear();
+private:
+  struct Chunk;
+  struct ChunkView;
+
+  struct Mapping {
+    uint64 offset;
+    void *base;
+    size_t length;
+    const char *data;
+    uint64 last_used;
+  };
+
+  // How many of the newest chunks are always kept in memory.
+  static constexpr size_t kHotChunks = 4;
+  // How many spilled chunks may be mapped in at once.
+  static constexpr size_t kMaxMappings = 16;
+
+  void DropOldest();
+  // Writes the chunk out to the spill file and frees its memory. If that fails, it just
+  // stays in memory.
+  void Spill(Chunk *chunk);
+  // Punches the chunk out of the spill file, if it's in there.
+  void Release(const Chunk &chunk);
+  // Returns a pointer to size bytes of the spill file at the given offset, or nullptr if
+  // they couldn't be mapped.
+  const char * Map(uint64 offset, size_t size);
+  void Unmap(uint64 offset);
+  bool View(const Chunk &chunk, ChunkView *view);
+
+  size_t m_max_lines{0};
+  tsm_screen_attr m_blank{};
+
+  std::deque<std::unique_ptr<Chunk>> m_chunks;
+  // How many lines at the start of the first chunk have been dropped already.
+  size_t m_first{0};
+  size_t m_size{0};
+  uint64 m_pushed{0};
+
+  int m_spill_fd{-1};
+  // Set once writing to the spill file fails, so it isn't retried for every chunk.
+  bool m_spill_failed{false};
+  uint64 m_spill_end{0}, m_spilled{0};
+  std::vector<Mapping> m_mappings;
+  uint64 m_map_clock{0};
+};
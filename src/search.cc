@@ -0,0 +1,49 @@
+#include "search.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+size_t FindSubstring(absl::string_view haystack, absl::string_view needle) {
+  constexpr size_t npos = absl::string_view::npos;
+
+  if (needle.empty()) {
+    return 0;
+  } else if (needle.size() > haystack.size()) {
+    return npos;
+  } else if (needle.size() == 1) {
+    auto p = static_cast<const char*>(memchr(haystack.data(), needle[0], haystack.size()));
+    return p != nullptr ? p - haystack.data() : npos;
+  }
+
+  const char *data = haystack.data();
+  size_t last = needle.size() - 1;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i first_byte = _mm_set1_epi8(needle.front());
+  const __m128i last_byte = _mm_set1_epi8(needle.back());
+
+  for (; i + last + 16 <= haystack.size(); i += 16) {
+    __m128i firsts = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    __m128i lasts = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + last));
+    uint mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(firsts, first_byte),
+                                                _mm_cmpeq_epi8(lasts, last_byte)));
+
+    while (mask != 0) {
+      size_t candidate = i + __builtin_ctz(mask);
+      if (memcmp(data + candidate + 1, needle.data() + 1, last - 1) == 0) {
+        return candidate;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  // Whatever's left is too short for a full block.
+  auto p = static_cast<const char*>(memmem(data + i, haystack.size() - i, needle.data(),
+                                           needle.size()));
+  return p != nullptr ? p - data : npos;
+}
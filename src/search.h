@@ -0,0 +1,11 @@
+#pragma once
+
+#include "base.h"
+
+#include <absl/strings/string_view.h>
+
+// Returns the offset of the first occurrence of needle in haystack, or
+// absl::string_view::npos if there isn't one. On x86, 16 possible starting positions are
+// ruled out at a time by checking the needle's first and last bytes with SSE2, and only
+// the ones left over are compared in full.
+size_t FindSubstring(absl::string_view haystack, absl::string_view needle);
@@ -1,10 +1,17 @@
 #include "terminal.h"
+#include "search.h"
+#include "trace.h"
+
+#include <utf8.h>
+
+#include <libtsm-scroll.h>
 
 #include <algorithm>
+#include <iterator>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#include <utf8.h>
-
 Terminal::Terminal() {
   tsm_screen_new(&m_screen, nullptr, nullptr);
   tsm_vte_new(&m_vte, m_screen, StaticWrite, static_cast<void*>(this), nullptr, nullptr);
@@ -16,75 +23,185 @@ Terminal::Terminal() {
 
   tattr.bold = tattr.underline = tattr.inverse = tattr.protect = tattr.blink = 0;
   tsm_screen_set_def_attr(m_screen, &tattr);
+  m_default_tattr = tattr;
 
-  constexpr int kMaxSb = 1024;
-  tsm_screen_set_max_sb(m_screen, kMaxSb);
+  // Lines that scroll off the screen go into m_scrollback instead.
+  tsm_screen_set_max_sb(m_screen, 0);
+  tsm_screen_set_scroll_cb(m_screen, StaticScroll, static_cast<void*>(this));
+  m_scrollback.set_blank_attr(tattr);
 
-  ResetSelection();
+  ResetSelectionLocked();
 }
 
-void Terminal::set_theme(const Theme& theme) { m_theme = &theme; }
+void Terminal::set_theme(const Theme& theme) {
+  m_theme = &theme;
+  m_attr_cache.fill(AttrCacheEntry{});
+}
 
 void Terminal::set_draw_cb(DrawCb draw_cb) { m_draw_cb = draw_cb; }
+void Terminal::set_scroll_cb(ScrollCb scroll_cb) { m_scroll_cb = scroll_cb; }
 void Terminal::set_copy_cb(CopyCb copy_cb) { m_copy_cb = copy_cb; }
 void Terminal::set_paste_cb(PasteCb paste_cb) { m_paste_cb = paste_cb; }
 void Terminal::set_title_cb(TitleCb title_cb) { m_title_cb = title_cb; }
 void Terminal::set_pty(Pty *pty) { m_pty = pty; }
 
+void Terminal::set_scrollback_lines(size_t lines) {
+  auto lock = Lock();
+
+  m_scrollback.set_max_lines(lines);
+
+  if (m_view_offset > m_scrollback.size()) {
+    m_view_offset = m_scrollback.size();
+    m_redraw_all = m_has_updated = true;
+  }
+}
+
+std::unique_lock<std::mutex> Terminal::Lock() {
+  m_lock_waiters++;
+  std::unique_lock<std::mutex> lock{m_lock};
+  if (--m_lock_waiters == 0) {
+    std::lock_guard<std::mutex> waiters_lock{m_waiters_lock};
+    m_waiters_cv.notify_all();
+  }
+  return lock;
+}
+
 Pos Terminal::cursor() {
+  auto lock = Lock();
   return {tsm_screen_get_cursor_x(m_screen), tsm_screen_get_cursor_y(m_screen)};
 }
 
 void Terminal::SetSelection(Selection state, uint x, uint y) {
+  auto lock = Lock();
+
+  LinePos pos{m_scrollback.pushed() - m_view_offset + y, x};
+
   switch (state) {
   case Selection::kBegin:
-    ResetSelection();
-    tsm_screen_selection_start(m_screen, x, y);
-    m_selection_range.begin = m_selection_range.end = m_selection_range.origin = {x, y};
+    ResetSelectionLocked();
+    m_selecting = true;
+    m_selection_range.begin = m_selection_range.end = m_selection_range.origin = pos;
     break;
   case Selection::kUpdate:
-    if (y < m_selection_range.origin.y ||
-        (y == m_selection_range.origin.y && x < m_selection_range.origin.x)) {
+    if (pos < m_selection_range.origin) {
       // Moving backwards: update the beginning offsets.
+      m_selection_range.begin = pos;
       m_selection_range.end = m_selection_range.origin;
-      m_selection_range.begin = {x, y};
     } else {
-      m_selection_range.end = {x, y};
+      m_selection_range.begin = m_selection_range.origin;
+      m_selection_range.end = pos;
     }
-
-    tsm_screen_selection_target(m_screen, x, y);
     break;
   case Selection::kEnd:
     assert(false);
   }
 
-  m_has_updated = true;
+  // Selected cells aren't marked as changed on the screen, so just redraw all of them.
+  m_redraw_all = m_has_updated = true;
 }
 
 void Terminal::EndSelection() {
+  auto lock = Lock();
+
   if (m_selection_range.begin == m_selection_range.end) {
-    ResetSelection();
-    m_has_updated = true;
+    ResetSelectionLocked();
   } else {
-    char *buf = nullptr;
-    uint sz = tsm_screen_selection_copy(m_screen, &buf);
-    m_selection_contents = string(buf, sz);
-    free(buf);
-   }
+    m_selection_contents = SelectionTextLocked();
+  }
 }
 
 void Terminal::ResetSelection() {
-  tsm_screen_selection_reset(m_screen);
+  auto lock = Lock();
+  ResetSelectionLocked();
+}
+
+void Terminal::ResetSelectionLocked() {
+  m_selecting = false;
   m_selection_range.begin = m_selection_range.end = m_selection_range.origin = {0, 0};
   m_selection_contents = "";
-  m_has_updated = true;
+  m_redraw_all = m_has_updated = true;
+}
+
+bool Terminal::SelectedLocked(uint64 line, uint x) {
+  LinePos pos{line, x};
+  return m_selecting && !(pos < m_selection_range.begin) &&
+         !(m_selection_range.end < pos);
+}
+
+tsm_screen_attr Terminal::HighlightLocked(const tsm_screen_attr &attr, uint64 line,
+                                          uint x) {
+  tsm_screen_attr result = attr;
+  if (SelectedLocked(line, x)) {
+    result.inverse = !result.inverse;
+  }
+
+  int match = FindMatchLocked(line, x);
+  if (match != -1) {
+    result.inverse = !result.inverse;
+    if (static_cast<size_t>(match) == m_current_match) {
+      result.underline = 1;
+    }
+  }
+
+  return result;
+}
+
+string Terminal::SelectionTextLocked() {
+  // The selection may run from the scrollback onto the screen, so grab the screen as it
+  // is right now for the latter part.
+  CaptureScreenLocked();
+
+  uint64 first_stored = m_scrollback.pushed() - m_scrollback.size();
+  uint64 first = std::max(m_selection_range.begin.line, first_stored);
+
+  string text;
+  for (uint64 line = first; line <= m_selection_range.end.line; line++) {
+    const std::vector<ScrollbackCell> *cells;
+    if (line < m_scrollback.pushed()) {
+      m_scrollback.Expand(line - first_stored, &m_expanded);
+      cells = &m_expanded;
+    } else if (line - m_scrollback.pushed() < m_screen_rows.size()) {
+      cells = &m_screen_rows[line - m_scrollback.pushed()];
+    } else {
+      break;
+    }
+
+    if (line != first) {
+      text.push_back('\n');
+    }
+
+    size_t line_start = text.size();
+    uint x = 0;
+    for (auto &cell : *cells) {
+      if (SelectedLocked(line, x)) {
+        utf8::unchecked::append(cell.ch != 0 ? cell.ch : ' ', std::back_inserter(text));
+      }
+      x += cell.width;
+    }
+
+    while (text.size() > line_start && text.back() == ' ') {
+      text.pop_back();
+    }
+  }
+
+  return text;
 }
 
 Error Terminal::Resize(int x, int y) {
-  tsm_screen_resize(m_screen, x, y);
-  m_has_updated = true;
+  {
+    auto lock = Lock();
+
+    // Shrinking the screen scrolls rows off the top, which StaticScroll picks up like any
+    // other scroll.
+    tsm_screen_resize(m_screen, x, y);
 
-  if (auto err = m_pty->Resize(x, y)) {
+    m_view_offset = std::min(m_view_offset, m_scrollback.size());
+    m_redraw_all = m_has_updated = true;
+  }
+
+  if (m_pty == nullptr) {
+    return Error::New();
+  } else if (auto err = m_pty->Resize(x, y)) {
     return err.Extend("resizing terminal");
   } else {
     return Error::New();
@@ -92,65 +209,763 @@ Error Terminal::Resize(int x, int y) {
 }
 
 void Terminal::Scroll(ScrollDirection direction, uint distance) {
+  auto lock = Lock();
+  ScrollLocked(direction, distance);
+}
+
+void Terminal::ScrollLocked(ScrollDirection direction, uint distance) {
+  size_t old_offset = m_view_offset;
+
   switch (direction) {
   case ScrollDirection::kUp:
-    tsm_screen_sb_up(m_screen, distance);
+    m_view_offset = std::min(m_view_offset + distance, m_scrollback.size());
     break;
   case ScrollDirection::kDown:
-    tsm_screen_sb_down(m_screen, distance);
+    m_view_offset -= std::min<size_t>(m_view_offset, distance);
     break;
   }
 
-  m_has_updated = true;
+  if (m_view_offset != old_offset) {
+    m_redraw_all = m_has_updated = true;
+  }
 }
 
-void Terminal::WriteToScreen(string text) {
-  tsm_vte_input(m_vte, text.c_str(), text.size());
-  m_has_updated = true;
+Error Terminal::SpillScrollback(const string &dir) {
+  auto lock = Lock();
+  return m_scrollback.EnableSpilling(dir);
+}
+
+void Terminal::ResetViewLocked() {
+  if (m_view_offset != 0) {
+    m_view_offset = 0;
+    m_redraw_all = m_has_updated = true;
+  }
+}
+
+// Packs the colors of an attribute, and its flags, into one word each.
+static uint64 PackTsmColors(const tsm_screen_attr &a) {
+  return static_cast<uint64>(static_cast<uint8_t>(a.fccode)) |
+         static_cast<uint64>(static_cast<uint8_t>(a.bccode)) << 8 |
+         static_cast<uint64>(a.fr) << 16 | static_cast<uint64>(a.fg) << 24 |
+         static_cast<uint64>(a.fb) << 32 | static_cast<uint64>(a.br) << 40 |
+         static_cast<uint64>(a.bg) << 48 | static_cast<uint64>(a.bb) << 56;
+}
+
+static uint32 PackTsmFlags(const tsm_screen_attr &a) {
+  return a.bold | a.italic << 1 | a.underline << 2 | a.inverse << 3 | a.protect << 4 |
+         a.blink << 5;
+}
+
+// FNV-1a, a word at a time.
+static constexpr uint64 kHashBasis = 14695981039346656037ull;
+
+static uint64 MixCell(uint64 hash, uint32 ch, uint width, const tsm_screen_attr &a) {
+  auto mix = [&](uint64 value) { hash = (hash ^ value) * 1099511628211ull; };
+
+  mix(static_cast<uint64>(ch) | static_cast<uint64>(width) << 32 |
+      static_cast<uint64>(PackTsmFlags(a)) << 40);
+  mix(PackTsmColors(a));
+  return hash;
+}
+
+void Terminal::CaptureScreenLocked() {
+  m_screen_rows.resize(tsm_screen_get_height(m_screen));
+  for (auto &row : m_screen_rows) {
+    row.clear();
+  }
+
+  if (tsm_screen_draw(m_screen, StaticCapture, static_cast<void*>(this)) == 0) {
+    // libtsm's ages wrapped around. It only says so once, so let the next snapshot know.
+    m_redraw_all = true;
+  }
+}
+
+void Terminal::WriteToScreen(absl::string_view text) {
+  // Parse in slices, so that the render thread never has to wait long to get at the
+  // screen (e.g. to handle a key press) while a flood of output is being parsed.
+  constexpr size_t kSliceSize = 16 * 1024;
+
+  TraceScope trace{"Terminal::WriteToScreen"};
+  trace.set_arg("bytes", text.size());
+  m_bytes_written.fetch_add(text.size(), std::memory_order_relaxed);
+
+  while (!text.empty()) {
+    if (m_lock_waiters.load() != 0) {
+      std::unique_lock<std::mutex> waiters_lock{m_waiters_lock};
+      m_waiters_cv.wait(waiters_lock, [&]() { return m_lock_waiters.load() == 0; });
+    }
+
+    std::unique_lock<std::mutex> lock{m_lock};
+
+    auto slice = text.substr(0, kSliceSize);
+    while (!slice.empty()) {
+      // The scanner stops at each mode change, so it can be acted on right where it was
+      // made. Lines that scroll off the screen are saved by StaticScroll as they go.
+      bool was_syncing = m_mode_scanner.enabled(ModeScanner::Mode::kSyncOutput);
+      auto part = slice.substr(0, m_mode_scanner.Scan(slice));
+      tsm_vte_input(m_vte, part.data(), part.size());
+      slice.remove_prefix(part.size());
+      text.remove_prefix(part.size());
+
+      string reply;
+      if (m_mode_scanner.TakeReply(&reply) && m_pty != nullptr) {
+        m_pty->Write(reply);
+      }
+      if (!was_syncing && m_mode_scanner.enabled(ModeScanner::Mode::kSyncOutput)) {
+        m_sync_start = std::chrono::steady_clock::now();
+      }
+    }
+
+    m_has_updated = true;
+    PublishLocked();
+  }
 }
 
-bool Terminal::WriteKeysymToPty(uint32 keysym, int mods) {
-  if (keysym == XKB_KEY_C && mods & KeyboardModifier::kControl &&
+bool Terminal::WriteKeysymToPty(uint32 keysym, int mods, bool *sent) {
+  auto lock = Lock();
+
+  if (sent != nullptr) {
+    *sent = false;
+  }
+
+  constexpr int kSearchMods = KeyboardModifier::kControl | KeyboardModifier::kShift;
+
+  if (m_searching) {
+    return HandleSearchKeyLocked(keysym, mods);
+  } else if (keysym == XKB_KEY_F && (mods & kSearchMods) == kSearchMods) {
+    // Search.
+    m_searching = true;
+    m_search_query.clear();
+    RestartSearchLocked();
+    return false;
+  } else if (keysym == XKB_KEY_C && mods & KeyboardModifier::kControl &&
       !m_selection_contents.empty()) {
     // Copy.
     m_copy_cb(m_selection_contents);
     return true;
   } else if (keysym == XKB_KEY_V && mods & KeyboardModifier::kControl) {
     // Paste.
-    auto u8 = m_paste_cb();
-    u32string u32;
-    utf8::utf8to32(u8.begin(), u8.end(), std::back_inserter(u32));
-
-    for (auto c : u32) {
-      WriteUnicodeToPty(c);
-    }
-
-    m_has_updated = true;
+    PasteLocked(m_paste_cb());
     return true;
   } else if (keysym == XKB_KEY_Up && mods & KeyboardModifier::kShift) {
-    Scroll(ScrollDirection::kUp, 1);
+    ScrollLocked(ScrollDirection::kUp, 1);
     return true;
   } else if (keysym == XKB_KEY_Down && mods & KeyboardModifier::kShift) {
-    Scroll(ScrollDirection::kDown, 1);
+    ScrollLocked(ScrollDirection::kDown, 1);
     return true;
   } else {
     m_has_updated = true;
-    return tsm_vte_handle_keyboard(m_vte, keysym, keysym, mods, TSM_VTE_INVALID);
+    if (!tsm_vte_handle_keyboard(m_vte, keysym, keysym, mods, TSM_VTE_INVALID)) {
+      return false;
+    }
+
+    if (sent != nullptr) {
+      *sent = true;
+    }
+    ResetViewLocked();
+    return true;
   }
 }
 
 bool Terminal::WriteUnicodeToPty(uint32 code) {
+  auto lock = Lock();
+  return WriteUnicodeToPtyLocked(code);
+}
+
+bool Terminal::WriteUnicodeToPtyLocked(uint32 code) {
+  if (m_searching) {
+    utf8::unchecked::append(code, std::back_inserter(m_search_query));
+    RestartSearchLocked();
+    return false;
+  }
+
   m_has_updated = true;
-  return tsm_vte_handle_keyboard(m_vte, XKB_KEY_NoSymbol, XKB_KEY_NoSymbol, 0, code);
+  if (!tsm_vte_handle_keyboard(m_vte, XKB_KEY_NoSymbol, XKB_KEY_NoSymbol, 0, code)) {
+    return false;
+  }
+
+  ResetViewLocked();
+  return true;
 }
 
-void Terminal::Draw() {
-  if (!m_has_updated) {
+void Terminal::PasteLocked(absl::string_view text) {
+  constexpr absl::string_view kPasteBegin = "\x1b[200~", kPasteEnd = "\x1b[201~";
+
+  if (m_pty == nullptr) {
     return;
   }
 
-  m_age = tsm_screen_draw(m_screen, StaticDraw, static_cast<void*>(this));
+  // Jump back down to the bottom, like typing would.
+  ResetViewLocked();
+
+  bool bracketed = m_mode_scanner.enabled(ModeScanner::Mode::kBracketedPaste);
+
+  // The whole thing is queued up in one go; the pty's write queue takes care of feeding
+  // it to the child as fast as it'll read it.
+  string data;
+  data.reserve(text.size() + kPasteBegin.size() + kPasteEnd.size());
+
+  if (bracketed) {
+    data.append(kPasteBegin.data(), kPasteBegin.size());
+  }
+
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '\n') {
+      // Newlines are sent like pressing Enter would, and CRLF becomes a single Enter.
+      if (i == 0 || text[i - 1] != '\r') {
+        data.push_back('\r');
+      }
+    } else if (bracketed && text.substr(i, kPasteEnd.size()) == kPasteEnd) {
+      // Don't let the text end the paste early.
+      i += kPasteEnd.size() - 1;
+    } else {
+      data.push_back(text[i]);
+    }
+  }
+
+  if (bracketed) {
+    data.append(kPasteEnd.data(), kPasteEnd.size());
+  }
+
+  m_pty->Write(data);
+}
+
+// How long each frame may spend searching through the scrollback.
+constexpr std::chrono::milliseconds kSearchBudget{4};
+
+bool Terminal::search_pending() {
+  auto lock = Lock();
+  return !m_search_done;
+}
+
+// How long a synchronized update may hold back output before it's drawn anyway, in case
+// the application never ends it.
+constexpr std::chrono::milliseconds kSyncTimeout{150};
+
+bool Terminal::sync_pending() {
+  auto lock = Lock();
+  return m_has_updated && m_mode_scanner.enabled(ModeScanner::Mode::kSyncOutput);
+}
+
+bool Terminal::SyncHeldLocked() {
+  return m_mode_scanner.enabled(ModeScanner::Mode::kSyncOutput) &&
+         std::chrono::steady_clock::now() - m_sync_start < kSyncTimeout;
+}
+
+bool Terminal::HandleSearchKeyLocked(uint32 keysym, int mods) {
+  switch (keysym) {
+  case XKB_KEY_Escape:
+    EndSearchLocked();
+    break;
+  case XKB_KEY_Return:
+  case XKB_KEY_KP_Enter:
+    // Enter goes to the next match up, and Shift+Enter back down.
+    if (m_match_count != 0) {
+      if (mods & KeyboardModifier::kShift) {
+        MoveToMatchLocked(m_current_match == 0 ? m_match_count - 1 : m_current_match - 1);
+      } else {
+        MoveToMatchLocked((m_current_match + 1) % m_match_count);
+      }
+    }
+    break;
+  case XKB_KEY_BackSpace:
+    // Drop the last character, along with any UTF-8 continuation bytes.
+    while (!m_search_query.empty()) {
+      char c = m_search_query.back();
+      m_search_query.pop_back();
+      if ((c & 0xc0) != 0x80) {
+        break;
+      }
+    }
+    RestartSearchLocked();
+    break;
+  default:
+    // Everything else is either typed into the query (see WriteUnicodeToPtyLocked) or
+    // ignored, but never sent to the child.
+    break;
+  }
+
+  return false;
+}
+
+void Terminal::EndSearchLocked() {
+  m_searching = false;
+  m_search_query.clear();
+  m_matches.clear();
+  m_window_first = m_match_count = m_current_match = 0;
+  m_search_done = true;
+  m_redraw_all = m_has_updated = true;
+}
+
+void Terminal::RestartSearchLocked() {
+  m_matches.clear();
+  m_window_first = m_match_count = m_current_match = 0;
+  m_search_next = m_scrollback.pushed();
+  m_search_done = m_search_query.empty();
+  m_redraw_all = m_has_updated = true;
+
+  if (m_search_done) {
+    return;
+  }
+
+  // The screen is searched right away.
+  CaptureScreenLocked();
+  m_chunk_matches.clear();
+  FindMatchesLocked(m_scrollback.pushed(), m_scrollback.pushed() + m_screen_rows.size(),
+                    &m_chunk_matches);
+  AddMatchesLocked();
+
+  StepSearchLocked(std::chrono::steady_clock::now() + kSearchBudget);
+}
+
+void Terminal::StepSearchLocked(std::chrono::steady_clock::time_point deadline) {
+  TraceScope trace{"Terminal::Search"};
+
+  bool had_matches = m_match_count != 0;
+
+  while (!m_search_done) {
+    // Lines may have been dropped from the top since the last step.
+    uint64 first_stored = m_scrollback.pushed() - m_scrollback.size();
+    if (m_search_next <= first_stored) {
+      m_search_done = true;
+      break;
+    }
+
+    uint64 begin = std::max(m_search_next, first_stored + Scrollback::kChunkLines) -
+                   Scrollback::kChunkLines;
+
+    m_chunk_matches.clear();
+    FindMatchesLocked(begin, m_search_next, &m_chunk_matches);
+    AddMatchesLocked();
+
+    m_search_next = begin;
+    if (std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+  }
+
+  if (!had_matches && m_match_count != 0) {
+    ShowMatchLocked();
+  }
+
+  // The prompt shows how far along the search is.
+  m_has_updated = true;
+  trace.set_arg("matches", m_match_count);
+}
+
+void Terminal::FindMatchesLocked(uint64 begin, uint64 end,
+                                 std::vector<SearchMatch> *matches) {
+  uint64 first_stored = m_scrollback.pushed() - m_scrollback.size();
+  uint64 first_screen = m_scrollback.pushed();
+
+  if (begin < first_screen && end > first_stored) {
+    size_t index_begin = std::max(begin, first_stored) - first_stored;
+    size_t index_end = std::min(end, first_screen) - first_stored;
+    m_scrollback.Find(m_search_query, index_begin, index_end,
+                      [&](size_t index, uint x, uint width) {
+      matches->push_back({first_stored + index, x, width});
+    });
+  }
+
+  string text;
+  std::vector<uint> cell_xs;
+
+  uint64 screen_end = first_screen + m_screen_rows.size();
+  for (uint64 line = std::max(begin, first_screen); line < std::min(end, screen_end);
+       line++) {
+    // Keep track of which cell each byte is in, so matches can be turned back into
+    // cells.
+    text.clear();
+    cell_xs.clear();
+    uint x = 0;
+    for (auto &cell : m_screen_rows[line - first_screen]) {
+      utf8::unchecked::append(cell.ch != 0 ? cell.ch : ' ', std::back_inserter(text));
+      cell_xs.resize(text.size(), x);
+      x += cell.width;
+    }
+    cell_xs.push_back(x);
+
+    for (size_t pos = 0; ; ) {
+      size_t match = FindSubstring(absl::string_view{text}.substr(pos), m_search_query);
+      if (match == absl::string_view::npos) {
+        break;
+      }
+      match += pos;
+
+      uint begin = cell_xs[match], end = cell_xs[match + m_search_query.size()];
+      matches->push_back({line, begin, end - begin});
+      pos = match + m_search_query.size();
+    }
+  }
+}
+
+void Terminal::AddMatchesLocked() {
+  for (auto it = m_chunk_matches.rbegin(); it != m_chunk_matches.rend(); ++it) {
+    // Only keep it if it would go right after the window's last match.
+    if (m_window_first + m_matches.size() == m_match_count &&
+        m_matches.size() < kMaxMatches) {
+      m_matches.push_back(*it);
+    }
+    m_match_count++;
+  }
+}
+
+int Terminal::FindMatchLocked(uint64 line, uint x) {
+  if (m_matches.empty()) {
+    return -1;
+  }
+
+  // Find the last match that starts at or before the position.
+  LinePos pos{line, x};
+  auto it = std::lower_bound(m_matches.begin(), m_matches.end(), pos,
+                             [](const SearchMatch &match, LinePos pos) {
+                               return pos < LinePos{match.line, match.x};
+                             });
+  if (it == m_matches.end() || it->line != line || x >= it->x + it->width) {
+    return -1;
+  }
+
+  return m_window_first + (it - m_matches.begin());
+}
+
+void Terminal::MoveToMatchLocked(size_t index) {
+  size_t window_end = m_window_first + m_matches.size();
+
+  if (index < m_window_first || index >= window_end) {
+    // The screen may have changed since the search started, so look at it again.
+    CaptureScreenLocked();
+
+    if (index == 0 || m_matches.empty()) {
+      // Wrapped around to the newest match, at the bottom.
+      LoadOlderMatchesLocked({m_scrollback.pushed() + m_screen_rows.size(), 0});
+      index = m_window_first = 0;
+    } else if (index == m_match_count - 1) {
+      // Wrapped around to the oldest match found so far.
+      LoadNewerMatchesLocked({m_search_next, 0}, true);
+      m_window_first = m_match_count - m_matches.size();
+    } else if (index == window_end) {
+      LoadOlderMatchesLocked(m_matches.back().pos());
+      m_window_first = index;
+    } else {
+      LoadNewerMatchesLocked(m_matches.front().pos(), false);
+      m_window_first = index + 1 - m_matches.size();
+    }
+  }
+
+  m_current_match = index;
+  ShowMatchLocked();
+}
+
+void Terminal::LoadOlderMatchesLocked(LinePos before) {
+  m_matches.clear();
+
+  uint64 first_stored = m_scrollback.pushed() - m_scrollback.size();
+  uint64 first_searched = std::max(m_search_next, first_stored);
+
+  // Walk up from the line the position is on, a chunk at a time.
+  for (uint64 end = before.line + 1; end > first_searched; ) {
+    uint64 begin = std::max(end, first_searched + Scrollback::kChunkLines) -
+                   Scrollback::kChunkLines;
+
+    m_chunk_matches.clear();
+    FindMatchesLocked(begin, end, &m_chunk_matches);
+    for (auto it = m_chunk_matches.rbegin(); it != m_chunk_matches.rend(); ++it) {
+      if (it->pos() < before) {
+        m_matches.push_back(*it);
+        if (m_matches.size() == kMaxMatches) {
+          return;
+        }
+      }
+    }
+
+    end = begin;
+  }
+}
+
+void Terminal::LoadNewerMatchesLocked(LinePos after, bool inclusive) {
+  m_matches.clear();
+
+  uint64 first_stored = m_scrollback.pushed() - m_scrollback.size();
+  uint64 screen_end = m_scrollback.pushed() + m_screen_rows.size();
+
+  // Walk down from the line the position is on, collecting them oldest first.
+  for (uint64 begin = std::max(after.line, first_stored); begin < screen_end; ) {
+    uint64 end = std::min(begin + Scrollback::kChunkLines, screen_end);
+
+    m_chunk_matches.clear();
+    FindMatchesLocked(begin, end, &m_chunk_matches);
+    for (auto &match : m_chunk_matches) {
+      if (after < match.pos() || (inclusive && !(match.pos() < after))) {
+        m_matches.push_back(match);
+        if (m_matches.size() == kMaxMatches) {
+          break;
+        }
+      }
+    }
+
+    if (m_matches.size() == kMaxMatches) {
+      break;
+    }
+    begin = end;
+  }
+
+  std::reverse(m_matches.begin(), m_matches.end());
+}
+
+void Terminal::ShowMatchLocked() {
+  // The matches might have changed out from under the window, e.g. if the lines they
+  // were on were dropped from the scrollback.
+  if (m_current_match < m_window_first ||
+      m_current_match - m_window_first >= m_matches.size()) {
+    return;
+  }
+
+  // The prompt covers the last row.
+  uint64 rows = tsm_screen_get_height(m_screen) - 1;
+  uint64 line = m_matches[m_current_match - m_window_first].line;
+  uint64 top = m_scrollback.pushed() - m_view_offset;
+
+  if (line < top || line >= top + rows) {
+    // Put it in the middle.
+    uint64 new_top = line > rows / 2 ? line - rows / 2 : 0;
+    m_view_offset = new_top < m_scrollback.pushed() ? m_scrollback.pushed() - new_top : 0;
+    m_view_offset = std::min(m_view_offset, m_scrollback.size());
+  }
+
+  m_redraw_all = m_has_updated = true;
+}
+
+void Terminal::SnapshotSearchPromptLocked(uint width, uint height) {
+  auto &cells = m_back.cells;
+  uint y = height - 1;
+  auto on_last_row = [&](const ScreenSnapshot::Cell &cell) { return cell.y == y; };
+  cells.erase(std::remove_if(cells.begin(), cells.end(), on_last_row), cells.end());
+
+  string status;
+  if (!m_search_done) {
+    status = "searching...";
+  } else if (m_match_count == 0) {
+    status = m_search_query.empty() ? "" : "no matches";
+  } else {
+    status = fmt::format("{} of {}", m_current_match + 1, m_match_count);
+  }
+
+  // The status goes on the right.
+  string prompt = fmt::format("search: {}", m_search_query);
+  size_t used = prompt.size() + status.size();
+  prompt.append(width > used ? width - used : 1, ' ');
+  prompt += status;
+
+  tsm_screen_attr attr = m_default_tattr;
+  attr.inverse = 1;
+
+  const char *p = prompt.data(), *end = prompt.data() + prompt.size();
+  for (uint x = 0; x < width; x++) {
+    uint32 ch = p < end ? utf8::unchecked::next(p) : ' ';
+    cells.push_back({ch, 1, x, y, attr});
+  }
+}
+
+size_t Terminal::Draw() {
+  TraceScope trace{"Terminal::Draw"};
+
+  // Whatever was already published goes first. Then, if nobody else is busy with the
+  // screen, publish and draw everything that changed since then too, so the frame isn't
+  // left behind (e.g. after a flood of output). Otherwise, WriteToScreen will publish it
+  // once it's done with its slice.
+  size_t drawn = DrawSnapshot();
+
+  if (m_lock.try_lock()) {
+    if (!m_search_done) {
+      StepSearchLocked(std::chrono::steady_clock::now() + kSearchBudget);
+    }
+    PublishLocked();
+    m_lock.unlock();
+    drawn += DrawSnapshot();
+  }
+
+  trace.set_arg("cells", drawn);
+  return drawn;
+}
+
+size_t Terminal::DrawSnapshot() {
+  {
+    std::unique_lock<std::mutex> lock{m_snapshot_lock};
+    if (!m_back_ready) {
+      return 0;
+    }
+
+    std::swap(m_back, m_front);
+    m_back_ready = false;
+  }
+
+  if (m_front.scroll.shift != 0 && m_scroll_cb) {
+    m_scroll_cb(m_front.scroll);
+  }
+
+  auto &cells = m_front.cells;
+  for (size_t begin = 0; begin < cells.size(); ) {
+    const auto &first = cells[begin];
+
+    // Extend the run for as long as the cells are next to each other and look the same.
+    size_t end = begin + 1;
+    while (end < cells.size() && cells[end].y == first.y &&
+           cells[end].x == cells[end - 1].x + 1 &&
+           SameTsmAttr(cells[end].attr, first.attr)) {
+      end++;
+    }
+
+    m_run_chars.clear();
+    for (size_t i = begin; i < end; i++) {
+      m_run_chars.push_back(cells[i].ch);
+    }
+
+    m_draw_cb(CellRun{{first.x, first.y}, ConvertAttr(first.attr), m_run_chars});
+    begin = end;
+  }
+
+  if (m_front.title_changed) {
+    m_title_cb(m_front.title);
+  }
+
+  return m_front.cells.size();
+}
+
+DamageStats Terminal::damage_stats() {
+  auto lock = Lock();
+  return m_damage;
+}
+
+ScrollbackStats Terminal::scrollback_stats() {
+  auto lock = Lock();
+  return {m_scrollback.size(), m_scrollback.memory_usage(), m_scrollback.spilled_bytes()};
+}
+
+void Terminal::PublishLocked() {
+  // Until a synchronized update ends, the screen may well be half drawn. m_has_updated
+  // stays set, so it all goes into the snapshot taken once it's over.
+  if (!m_has_updated || SyncHeldLocked()) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock{m_snapshot_lock};
+  if (m_back_ready) {
+    // The render thread hasn't picked up the last one yet. m_has_updated stays set, so
+    // these changes will go into the next one.
+    return;
+  }
+
+  TraceScope trace{"Terminal::Publish"};
+
+  m_back.cells.clear();
+  m_back.scroll = ScrollRegion{};
+  m_back.rows_changed = m_back.rows_scrolled = 0;
+  m_snapshot_row = -1;
+
+  // When scrolled back, the screen's rows are all in different places than last time.
+  bool redraw_all = m_redraw_all || m_view_offset != 0;
+  if (redraw_all) {
+    m_age = 0;
+  }
+
+  m_track_rows = m_view_offset == 0 && !m_searching;
+  if (m_track_rows) {
+    m_snapshot_rows.assign(tsm_screen_get_height(m_screen), {kHashBasis, 0, 0});
+  }
+
+  // Only the cells that changed since m_age are copied into the snapshot, so Draw never
+  // sees the rest.
+  m_age = tsm_screen_draw(m_screen, StaticSnapshot, static_cast<void*>(this));
+  m_redraw_all = false;
+
+  if (m_track_rows) {
+    if (!redraw_all) {
+      ApplyScrollLocked();
+    }
+
+    m_published_hashes.resize(m_snapshot_rows.size());
+    for (size_t y = 0; y < m_snapshot_rows.size(); y++) {
+      m_published_hashes[y] = m_snapshot_rows[y].hash;
+    }
+  } else {
+    m_published_hashes.clear();
+  }
+
+  if (m_view_offset != 0) {
+    SnapshotHistoryLocked(tsm_screen_get_width(m_screen),
+                          tsm_screen_get_height(m_screen));
+  }
+  if (m_searching) {
+    SnapshotSearchPromptLocked(tsm_screen_get_width(m_screen),
+                               tsm_screen_get_height(m_screen));
+  }
+
+  m_pending_scroll = ScrollRegion{};
+  m_scroll_conflict = false;
+
+  m_damage.snapshots++;
+  m_damage.rows_changed += m_back.rows_changed;
+  m_damage.rows_scrolled += m_back.rows_scrolled;
+
+  m_back.title_changed = m_title_changed;
+  if (m_title_changed) {
+    m_back.title = m_title;
+    m_title_changed = false;
+  }
+
+  m_back_ready = true;
   m_has_updated = false;
+
+  trace.set_arg("rows_changed", m_back.rows_changed);
+}
+
+void Terminal::ApplyScrollLocked() {
+  auto &rows = m_snapshot_rows;
+  auto &cells = m_back.cells;
+  const auto &scroll = m_pending_scroll;
+  uint height = rows.size(), distance = std::abs(scroll.shift);
+  if (m_scroll_conflict || scroll.shift == 0 || m_published_hashes.size() != height ||
+      scroll.bottom > height || scroll.top + distance >= scroll.bottom) {
+    return;
+  }
+
+  // Each row's changed cells run up to where the next row's start.
+  auto row_end = [&](uint y) {
+    return y + 1 < height ? rows[y + 1].first : cells.size();
+  };
+  auto in_full = [&](uint y) { return row_end(y) - rows[y].first == rows[y].cells; };
+
+  // Row y of the moved ones came from row y + shift. It only needs drawing if it changed
+  // after it moved, and then all of it does, since the rest of it moved too. The rows
+  // that scrolled into view always have to be drawn in full.
+  uint moved_begin = scroll.shift > 0 ? scroll.top : scroll.top + distance;
+  uint moved_end = moved_begin + (scroll.bottom - scroll.top - distance);
+  auto only_moved = [&](uint y) {
+    return y >= moved_begin && y < moved_end &&
+           rows[y].hash == m_published_hashes[y + scroll.shift];
+  };
+
+  for (uint y = scroll.top; y < scroll.bottom; y++) {
+    if (!only_moved(y) && !in_full(y)) {
+      return;
+    }
+  }
+
+  size_t kept = rows[scroll.top].first;
+  for (uint y = scroll.top; y < height; y++) {
+    size_t begin = rows[y].first, end = row_end(y);
+    if (y < scroll.bottom && only_moved(y)) {
+      m_back.rows_changed -= begin != end;
+      m_back.rows_scrolled++;
+      continue;
+    }
+
+    std::move(cells.begin() + begin, cells.begin() + end, cells.begin() + kept);
+    kept += end - begin;
+  }
+
+  cells.erase(cells.begin() + kept, cells.end());
+  m_back.scroll = scroll;
 }
 
 static SkColor TsmAttrColorCodeToSkColor(const Theme& theme, int code, bool bold) {
@@ -160,31 +975,171 @@ static SkColor TsmAttrColorCodeToSkColor(const Theme& theme, int code, bool bold
   return theme[std::min(code, Colors::kMax)];
 }
 
-int Terminal::StaticDraw(tsm_screen *screen, uint64 id, const uint32 *chars, size_t len,
-                         uint width, uint posx, uint posy, const tsm_screen_attr *tattr,
-                         tsm_age_t age, void *data) {
+int Terminal::StaticSnapshot(tsm_screen *screen, uint64 id, const uint32 *chars,
+                             size_t len, uint width, uint posx, uint posy,
+                             const tsm_screen_attr *tattr, tsm_age_t age, void *data) {
   Terminal *term = static_cast<Terminal*>(data);
+  auto &snapshot = term->m_back;
+
+  if (term->m_track_rows && static_cast<int>(posy) != term->m_snapshot_row &&
+      posy < term->m_snapshot_rows.size()) {
+    term->m_snapshot_row = posy;
+    term->m_snapshot_rows[posy].first = snapshot.cells.size();
+  }
+
+  // Rows pushed off the bottom by the scrollback above them aren't in view.
+  uint y = posy + term->m_view_offset;
+  if (y >= tsm_screen_get_height(screen)) {
+    return 0;
+  }
+
+  uint32 ch = len ? chars[0] : 0;
+  auto attr = term->HighlightLocked(*tattr, term->m_scrollback.pushed() + posy, posx);
+
+  // Every cell goes into its row's hash, changed or not.
+  if (term->m_track_rows && posy < term->m_snapshot_rows.size()) {
+    auto &row = term->m_snapshot_rows[posy];
+    row.hash = MixCell(row.hash, ch, width, attr);
+    row.cells++;
+  }
 
   if (term->m_age != 0 && age != 0 && age <= term->m_age) {
     return 0;
   }
 
-  u32string utf32(len, '\0');
-  std::copy(chars, chars + len, utf32.begin());
+  // Cells come in row by row, so this is the first changed one in its row if the last
+  // one was elsewhere.
+  if (snapshot.cells.empty() || snapshot.cells.back().y != y) {
+    snapshot.rows_changed++;
+  }
 
-  Pos pos{posx, posy};
+  snapshot.cells.push_back({ch, width, posx, y, attr});
+  return 0;
+}
+
+int Terminal::StaticCapture(tsm_screen *screen, uint64 id, const uint32 *chars,
+                            size_t len, uint width, uint posx, uint posy,
+                            const tsm_screen_attr *tattr, tsm_age_t age, void *data) {
+  Terminal *term = static_cast<Terminal*>(data);
+
+  // The cells covered by a wide character have no width of their own.
+  if (posy < term->m_screen_rows.size() && width != 0) {
+    term->m_screen_rows[posy].push_back({len ? chars[0] : 0, width, *tattr});
+  }
+  return 0;
+}
+
+int Terminal::StaticCaptureLine(tsm_screen *screen, uint64 id, const uint32 *chars,
+                                size_t len, uint width, uint posx, uint posy,
+                                const tsm_screen_attr *tattr, tsm_age_t age,
+                                void *data) {
+  Terminal *term = static_cast<Terminal*>(data);
+
+  if (width != 0) {
+    term->m_scrolled_line.push_back({len ? chars[0] : 0, width, *tattr});
+  }
+  return 0;
+}
+
+void Terminal::StaticScroll(tsm_screen *screen, uint top, uint bottom, int shift,
+                            void *data) {
+  Terminal *term = static_cast<Terminal*>(data);
+
+  auto &pending = term->m_pending_scroll;
+  if (pending.shift == 0 && !term->m_scroll_conflict) {
+    pending = ScrollRegion{top, bottom, shift};
+  } else if (pending.top == top && pending.bottom == bottom) {
+    pending.shift += shift;
+  } else {
+    term->m_scroll_conflict = true;
+  }
+
+  // Only lines scrolling off the top of the main screen are kept, not ones leaving a
+  // scroll region further down or the alternate screen.
+  if (top != 0 || shift <= 0 || term->m_scrollback.max_lines() == 0 ||
+      tsm_screen_get_flags(screen) & TSM_SCREEN_ALTERNATE) {
+    return;
+  }
+
+  for (int y = 0; y < shift; y++) {
+    term->m_scrolled_line.clear();
+    tsm_screen_draw_line(screen, y, StaticCaptureLine, data);
+    term->m_scrollback.Push(term->m_scrolled_line);
+  }
+
+  if (term->m_view_offset != 0) {
+    // Stay on the same lines.
+    term->m_view_offset = std::min(term->m_view_offset + shift,
+                                   term->m_scrollback.size());
+  }
+}
+
+void Terminal::SnapshotHistoryLocked(uint width, uint height) {
+  auto &snapshot = m_back;
+
+  uint rows = std::min<size_t>(m_view_offset, height);
+  size_t first = m_scrollback.size() - m_view_offset;
+  uint64 first_line = m_scrollback.pushed() - m_view_offset;
+
+  for (uint y = 0; y < rows; y++) {
+    m_scrollback.Expand(first + y, &m_expanded);
+    uint64 line = first_line + y;
+
+    uint x = 0;
+    for (auto &cell : m_expanded) {
+      if (x + cell.width > width) {
+        break;
+      }
+
+      snapshot.cells.push_back({cell.ch, cell.width, x, y,
+                                HighlightLocked(cell.attr, line, x)});
+      x += cell.width;
+    }
+
+    // Stored lines have their trailing blanks cut off, so fill the rest in.
+    for (; x < width; x++) {
+      snapshot.cells.push_back({0, 1, x, y, HighlightLocked(m_default_tattr, line, x)});
+    }
+  }
+
+  snapshot.rows_changed += rows;
+}
+
+// Set in the flags of every key in the attribute cache, so empty entries never match.
+static constexpr uint32 kAttrKeyValid = 1u << 31;
+
+Attr Terminal::ConvertAttr(const tsm_screen_attr &tattr) {
+  uint64 colors = PackTsmColors(tattr);
+  uint32 flags = PackTsmFlags(tattr) | kAttrKeyValid;
+
+  // Fibonacci hashing, taking the top bits as the slot.
+  uint64 hash = (colors ^ flags) * 11400714819323198485ull;
+  auto &entry = m_attr_cache[hash >> (64 - kAttrCacheBits)];
+
+  m_attr_cache_stats.lookups++;
+  if (entry.colors == colors && entry.flags == flags) {
+    m_attr_cache_stats.hits++;
+    return entry.attr;
+  }
+
+  entry.colors = colors;
+  entry.flags = flags;
+  entry.attr = ConvertAttrUncached(tattr);
+  return entry.attr;
+}
+
+Attr Terminal::ConvertAttrUncached(const tsm_screen_attr &cell_attr) {
+  const tsm_screen_attr *tattr = &cell_attr;
 
   Attr attr;
 
   if (tattr->fccode >= 0) {
-    attr.foreground = TsmAttrColorCodeToSkColor(*term->m_theme, tattr->fccode,
-                                                tattr->bold);
+    attr.foreground = TsmAttrColorCodeToSkColor(*m_theme, tattr->fccode, tattr->bold);
   } else {
     attr.foreground = SkColorSetRGB(tattr->fr, tattr->fg, tattr->fb);
   }
   if (tattr->bccode >= 0) {
-    attr.background = TsmAttrColorCodeToSkColor(*term->m_theme, tattr->bccode,
-                                                tattr->bold);
+    attr.background = TsmAttrColorCodeToSkColor(*m_theme, tattr->bccode, tattr->bold);
   } else {
     attr.background = SkColorSetRGB(tattr->br, tattr->bg, tattr->bb);
   }
@@ -206,18 +1161,14 @@ int Terminal::StaticDraw(tsm_screen *screen, uint64 id, const uint32 *chars, siz
     attr.flags |= Attr::kProtect;
   }
 
-  term->m_draw_cb(utf32, pos, attr, width);
-  return 0;
+  return attr;
 }
 
 void Terminal::StaticWrite(tsm_vte *vte, const char *u8, size_t len, void *data) {
   Terminal *term = static_cast<Terminal*>(data);
 
-  string text(u8, len);
   if (term->m_pty != nullptr) {
-    if (auto err = term->m_pty->Write(text)) {
-      err.Extend("in StaticWrite").Print();
-    }
+    term->m_pty->Write(absl::string_view{u8, len});
   }
 }
 
@@ -225,7 +1176,9 @@ void Terminal::StaticOsc(tsm_vte *vte, const char *u8, size_t len, void *data) {
   Terminal *term = static_cast<Terminal*>(data);
 
   if (u8[0] == '2' && u8[1] == ';') {
-    string text(u8 + 2, len - 2);
-    term->m_title_cb(text);
+    // This is called while parsing, which may not be on the render thread, so the title
+    // is passed along with the next snapshot.
+    term->m_title = string(u8 + 2, len - 2);
+    term->m_title_changed = true;
   }
 }
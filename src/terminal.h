@@ -4,8 +4,19 @@
 #include "error.h"
 #include "pty.h"
 #include "attrs.h"
+#include "mode_scanner.h"
+#include "scrollback.h"
 
+#include <absl/strings/string_view.h>
+#include <absl/types/span.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+#include <vector>
 
 #include <libtsm.h>
 
@@ -23,23 +34,97 @@ struct Pos {
   bool operator==(Pos rhs) { return x == rhs.x && y == rhs.y; }
 };
 
-struct SelectionRange { Pos begin{0, 0}, end{0, 0}, origin{0, 0}; };
+// A position in the terminal's history. Lines are numbered from the first one that was
+// ever on the screen, so a position stays with its text as it scrolls up.
+struct LinePos {
+  uint64 line;
+  uint x;
+
+  bool operator==(LinePos rhs) const { return line == rhs.line && x == rhs.x; }
+  bool operator<(LinePos rhs) const {
+    return line < rhs.line || (line == rhs.line && x < rhs.x);
+  }
+};
+
+struct SelectionRange { LinePos begin{0, 0}, end{0, 0}, origin{0, 0}; };
+
+// A CellRun is a horizontal run of cells that all have the same attributes. chars holds
+// one character per cell (0 for a blank one), starting at pos. It's only valid for the
+// duration of the draw callback it's passed to.
+struct CellRun {
+  Pos pos;
+  Attr attr;
+  absl::Span<const char32_t> chars;
+};
+
+// The rows from top up to bottom moving shift rows up (or down, if it's negative), as if
+// by a scroll. Rows that come into view from outside of the range are left as they were.
+struct ScrollRegion {
+  uint top{0}, bottom{0};
+  int shift{0};
+};
+
+// A ScreenSnapshot is an immutable copy of the cells that changed between two draws. It's
+// filled in by whichever thread last touched the screen, and then handed over to the
+// render thread, so drawing never has to wait for parsing to finish.
+struct ScreenSnapshot {
+  struct Cell {
+    uint32 ch;
+    uint width, x, y;
+    tsm_screen_attr attr;
+  };
+
+  // If its shift isn't 0, this applies before any of the cells. The rows it moves are
+  // left out of cells, unless they changed again after moving.
+  ScrollRegion scroll;
+  std::vector<Cell> cells;
+  // How many rows had changed cells (i.e. appear in cells), and how many were moved by
+  // the scroll instead.
+  uint rows_changed{0}, rows_scrolled{0};
+  bool title_changed{false};
+  string title;
+};
+
+// Running totals of how many rows the published snapshots had to redraw or move.
+struct DamageStats {
+  uint64 snapshots{0}, rows_changed{0}, rows_scrolled{0};
+};
+
+// How many attributes were converted for drawing, and how many of those were already in
+// the cache.
+struct AttrCacheStats {
+  uint64 lookups{0}, hits{0};
+};
+
+struct ScrollbackStats {
+  size_t lines, bytes;
+  uint64 spilled_bytes;
+};
 
+// A Terminal may be written to (via WriteToScreen) from any one thread, e.g. one that's
+// reading from the pty, while everything else happens on the render thread.
 class Terminal {
 public:
   Terminal();
 
-  using DrawCb = std::function<void(const u32string&, Pos, Attr, int)>;
+  using DrawCb = std::function<void(const CellRun&)>;
+  using ScrollCb = std::function<void(const ScrollRegion&)>;
   using CopyCb = std::function<void(const string&)>;
   using PasteCb = std::function<string()>;
   using TitleCb = std::function<void(const string&)>;
 
   void set_theme(const Theme& theme);
   void set_draw_cb(DrawCb draw_cb);
+  // Called before the runs of a snapshot that scrolled part of the screen.
+  void set_scroll_cb(ScrollCb scroll_cb);
   void set_copy_cb(CopyCb copy_cb);
   void set_paste_cb(PasteCb paste_cb);
   void set_title_cb(TitleCb title_cb);
   void set_pty(Pty* pty);
+  // How many lines that have scrolled off the screen are kept around.
+  void set_scrollback_lines(size_t lines);
+  // Moves old scrollback out of memory into a file in the given directory.
+  Error SpillScrollback(const string &dir);
 
   Pos cursor();
 
@@ -51,31 +136,223 @@ public:
 
   const Attr & default_attr() { return m_default_attr; }
   Error Resize(int x, int y);
-  void WriteToScreen(string text);
-  bool WriteKeysymToPty(uint32 keysym, int mods);
+  void WriteToScreen(absl::string_view text);
+  // The total number of bytes passed to WriteToScreen so far. May be called from any
+  // thread.
+  uint64 bytes_written() const { return m_bytes_written.load(std::memory_order_relaxed); }
+  // Returns whether the key did anything. If it was sent on to the child as input (rather
+  // than e.g. copying, pasting or scrolling), also sets *sent.
+  bool WriteKeysymToPty(uint32 keysym, int mods, bool *sent = nullptr);
+  // Returns whether the character was sent on to the child.
   bool WriteUnicodeToPty(uint32 code);
-  void Draw();
+  // Picks up the latest snapshot and calls the draw callback for each run of cells in
+  // it, and returns the number of cells drawn. Must be called from the render thread.
+  size_t Draw();
+  DamageStats damage_stats();
+  // Must be called from the render thread.
+  AttrCacheStats attr_cache_stats() { return m_attr_cache_stats; }
+  ScrollbackStats scrollback_stats();
+  // Whether a search is still working its way through the scrollback, so the caller
+  // should keep drawing frames for it to make progress.
+  bool search_pending();
+  // Whether there's output being held back until the application finishes a synchronized
+  // update (or it times out), so the caller should keep drawing frames to pick it up.
+  bool sync_pending();
 private:
-  static int StaticDraw(tsm_screen *screen, uint64 id, const uint32 *chars, size_t len,
-                        uint width, uint posx, uint posy, const tsm_screen_attr *tattr,
-                        tsm_age_t age, void *data);
+  struct SearchMatch {
+    uint64 line;
+    uint x, width;
+
+    LinePos pos() const { return {line, x}; }
+  };
+
+  // Locks m_lock, letting WriteToScreen know that someone is waiting on it so it steps
+  // aside between slices.
+  std::unique_lock<std::mutex> Lock();
+
+  void ResetSelectionLocked();
+  bool SelectedLocked(uint64 line, uint x);
+  // Returns attr, inverted if the given position is selected or part of a search match.
+  tsm_screen_attr HighlightLocked(const tsm_screen_attr &attr, uint64 line, uint x);
+  string SelectionTextLocked();
+  void ScrollLocked(ScrollDirection direction, uint distance);
+  // Jumps back down to the bottom of the scrollback.
+  void ResetViewLocked();
+  // Captures the whole screen into m_screen_rows.
+  void CaptureScreenLocked();
+  // Adds the rows of the view that come from the scrollback to the back snapshot.
+  void SnapshotHistoryLocked(uint width, uint height);
+
+  // Handles a key press while searching. Returns false if it wasn't used.
+  bool HandleSearchKeyLocked(uint32 keysym, int mods);
+  void EndSearchLocked();
+  // Throws away the matches and starts searching for the current query again, from the
+  // bottom of the screen up.
+  void RestartSearchLocked();
+  // Searches further back through the scrollback until the deadline passes.
+  void StepSearchLocked(std::chrono::steady_clock::time_point deadline);
+  // Appends the matches in the lines from begin up to end to matches, oldest first. The
+  // screen's lines come from the last capture.
+  void FindMatchesLocked(uint64 begin, uint64 end, std::vector<SearchMatch> *matches);
+  // Counts the newly found matches in m_chunk_matches (which come oldest first), and
+  // keeps them if the window has room for them.
+  void AddMatchesLocked();
+  // Returns the index of the match covering the given position, or -1.
+  int FindMatchLocked(uint64 line, uint x);
+  // Makes the given match the current one, finding it again if it's outside the window,
+  // and scrolls the view so it's on it.
+  void MoveToMatchLocked(size_t index);
+  // Refills the window with up to kMaxMatches of the matches found so far that come
+  // before (older than) or after (newer than) the given position.
+  void LoadOlderMatchesLocked(LinePos before);
+  void LoadNewerMatchesLocked(LinePos after, bool inclusive);
+  // Scrolls the view so the current match is on it.
+  void ShowMatchLocked();
+  // Replaces the last row of the back snapshot with the search prompt.
+  void SnapshotSearchPromptLocked(uint width, uint height);
+  bool WriteUnicodeToPtyLocked(uint32 code);
+  void PasteLocked(absl::string_view text);
+  // Whether the application is in the middle of a synchronized update (DEC mode 2026),
+  // and hasn't taken too long over it yet.
+  bool SyncHeldLocked();
+  void PublishLocked();
+  // If libtsm reported a scroll since the last snapshot was published, has the back
+  // snapshot scroll too, and drops the rows it moved from it if they still match the ones
+  // they came from.
+  void ApplyScrollLocked();
+  // Swaps in the back snapshot and draws it, if it's ready. Returns the number of cells
+  // drawn.
+  size_t DrawSnapshot();
+  // Looks the attribute up in m_attr_cache, converting it on a miss.
+  Attr ConvertAttr(const tsm_screen_attr &tattr);
+  Attr ConvertAttrUncached(const tsm_screen_attr &tattr);
+
+  static int StaticSnapshot(tsm_screen *screen, uint64 id, const uint32 *chars,
+                            size_t len, uint width, uint posx, uint posy,
+                            const tsm_screen_attr *tattr, tsm_age_t age, void *data);
+  static int StaticCapture(tsm_screen *screen, uint64 id, const uint32 *chars,
+                           size_t len, uint width, uint posx, uint posy,
+                           const tsm_screen_attr *tattr, tsm_age_t age, void *data);
+  static int StaticCaptureLine(tsm_screen *screen, uint64 id, const uint32 *chars,
+                               size_t len, uint width, uint posx, uint posy,
+                               const tsm_screen_attr *tattr, tsm_age_t age, void *data);
+  // Called by libtsm (via our patch) right before part of the screen scrolls. Saves lines
+  // leaving the top of the screen, and adds the scroll to m_pending_scroll.
+  static void StaticScroll(tsm_screen *screen, uint top, uint bottom, int shift,
+                           void *data);
   static void StaticWrite(tsm_vte *vte, const char *u8, size_t len, void *data);
   static void StaticOsc(tsm_vte *vte, const char *u8, size_t len, void *data);
 
   const Theme *m_theme{nullptr};
 
   DrawCb m_draw_cb;
+  ScrollCb m_scroll_cb;
   CopyCb m_copy_cb;
   PasteCb m_paste_cb;
   TitleCb m_title_cb;
 
+  std::atomic<uint64> m_bytes_written{0};
+
+  // Guards the screen, the VTE, and everything else below up to the snapshots.
+  std::mutex m_lock;
+  // How many threads are blocked in Lock(). WriteToScreen waits on m_waiters_cv for it to
+  // drop back to zero before taking the next slice.
+  std::atomic<int> m_lock_waiters{0};
+  std::mutex m_waiters_lock;
+  std::condition_variable m_waiters_cv;
+
   tsm_screen *m_screen;
   tsm_vte *m_vte;
+  ModeScanner m_mode_scanner;
+  // When the current synchronized update began.
+  std::chrono::steady_clock::time_point m_sync_start;
 
   SelectionRange m_selection_range;
+  bool m_selecting{false};
   string m_selection_contents;
   bool m_has_updated{false};
+  // Set when the next snapshot needs every cell, not just the ones that changed.
+  bool m_redraw_all{false};
   int m_age{0};
+  // The last row StaticSnapshot saw while tracking rows for the current snapshot.
+  int m_snapshot_row{-1};
+
+  struct SnapshotRow {
+    uint64 hash;
+    // How many cells the row has, and where its changed ones start in the snapshot.
+    uint cells;
+    size_t first;
+  };
+
+  // Set while taking a snapshot of the screen as it is (i.e. not scrolled back or under
+  // the search prompt), which is when the rows are tracked for ApplyScrollLocked.
+  bool m_track_rows{false};
+  std::vector<SnapshotRow> m_snapshot_rows;
+  // The hash of each row as of the last snapshot published, or empty if it wasn't
+  // tracked.
+  std::vector<uint64> m_published_hashes;
+  // What libtsm scrolled since the last snapshot was published. Scrolls of the same
+  // region add up; if more than one region scrolled, m_scroll_conflict is set and none of
+  // them are used.
+  ScrollRegion m_pending_scroll;
+  bool m_scroll_conflict{false};
+  DamageStats m_damage;
   Attr m_default_attr;
-  Pty *m_pty;
+  tsm_screen_attr m_default_tattr;
+  Pty *m_pty{nullptr};
+
+  bool m_title_changed{false};
+  string m_title;
+
+  Scrollback m_scrollback;
+  // How many lines up into the scrollback the view is.
+  size_t m_view_offset{0};
+  // The screen as of the last CaptureScreenLocked, row by row. It's only captured when
+  // it's needed, e.g. to search it or copy from it.
+  std::vector<std::vector<ScrollbackCell>> m_screen_rows;
+  // Holds a line that's scrolling off the top of the screen on its way to the scrollback.
+  std::vector<ScrollbackCell> m_scrolled_line;
+  // Holds a line expanded from the scrollback.
+  std::vector<ScrollbackCell> m_expanded;
+
+  // Only this many matches are kept at once, in a window around the current one. The rest
+  // are only counted, and found again when they're moved to.
+  static constexpr size_t kMaxMatches = 4096;
+
+  bool m_searching{false};
+  string m_search_query;
+  // The window of matches, newest first, i.e. sorted from the bottom of the screen up.
+  // Matches are numbered the same way, from 0 for the newest of all of them, and the
+  // window starts at m_window_first.
+  std::vector<SearchMatch> m_matches;
+  size_t m_window_first{0}, m_match_count{0}, m_current_match{0};
+  // Lines from here on up haven't been searched yet.
+  uint64 m_search_next{0};
+  bool m_search_done{true};
+  // The lines in the scrollback are searched a chunk at a time, and their matches are
+  // collected here first since they come in the opposite order to m_matches.
+  std::vector<SearchMatch> m_chunk_matches;
+
+  // The back snapshot is filled in with m_lock held and then marked as ready; the render
+  // thread swaps it to the front once it's ready. m_snapshot_lock guards the back
+  // snapshot and the ready flag. The front one is only ever touched by the render thread.
+  std::mutex m_snapshot_lock;
+  ScreenSnapshot m_back, m_front;
+  bool m_back_ready{false};
+  // Holds the characters of the run being drawn, so they're contiguous.
+  std::vector<char32_t> m_run_chars;
+
+  // A screen only has a handful of distinct attributes at once, so their conversions are
+  // kept in a small direct-mapped cache, keyed on the attribute's bits. It's only used by
+  // the render thread, and cleared whenever the theme changes.
+  struct AttrCacheEntry {
+    uint64 colors{0};
+    // Has kAttrKeyValid set for any entry that's in use.
+    uint32 flags{0};
+    Attr attr;
+  };
+
+  static constexpr int kAttrCacheBits = 6;
+  std::array<AttrCacheEntry, 1 << kAttrCacheBits> m_attr_cache;
+  AttrCacheStats m_attr_cache_stats;
 };
@@ -22,10 +22,6 @@ GlyphRenderer::GlyphRenderer() {
   }
 }
 
-void GlyphRenderer::Resize(int size) {
-  m_glyphs.resize(size);
-}
-
 void GlyphRenderer::SetTextSize(int height) {
   for (auto &styled_font : m_styled_fonts) {
     styled_font.font.setSize(SkIntToScalar(height));
@@ -48,23 +44,32 @@ void GlyphRenderer::SetFont(string name) {
   UpdateForFontChange();
 }
 
-bool GlyphRenderer::UpdateGlyph(char32_t c, int index, FontStyle style) {
-  auto &styled_font = m_styled_fonts[FontStyleToInt(style)];
-
+SkGlyphID GlyphRenderer::FindGlyph(StyledFont *styled_font, char32_t c) {
   if (c < kCharMax) {
-    auto glyph = styled_font.glyph_cache[c];
+    auto glyph = styled_font->glyph_cache[c];
     if (glyph) {
-      m_glyphs[index] = glyph;
-      return true;
+      return glyph;
     }
   }
 
-  styled_font.font.textToGlyphs(&c, sizeof(c), kUTF32_SkTextEncoding, &m_glyphs[index], 1);
-  return m_glyphs[index] != 0;
+  SkGlyphID glyph;
+  if (!styled_font->unicode_cache.Find(c, &glyph)) {
+    styled_font->font.textToGlyphs(&c, sizeof(c), kUTF32_SkTextEncoding, &glyph, 1);
+    styled_font->unicode_cache.Insert(c, glyph);
+  }
+  return glyph;
+}
+
+SkGlyphID GlyphRenderer::FindGlyph(char32_t c, FontStyle style) {
+  return FindGlyph(&m_styled_fonts[FontStyleToInt(style)], c);
 }
 
-void GlyphRenderer::ClearGlyph(int index) {
-  m_glyphs[index] = m_styled_fonts[kStyleNormal].glyph_cache[' '];
+GlyphCacheStats GlyphRenderer::glyph_cache_stats() {
+  GlyphCacheStats stats;
+  for (auto &styled_font : m_styled_fonts) {
+    stats += styled_font.unicode_cache.stats();
+  }
+  return stats;
 }
 
 SkScalar GlyphRenderer::FindHeight() {
@@ -96,64 +101,78 @@ SkScalar GlyphRenderer::FindBaselineOffset() {
   return m_styled_fonts[kStyleNormal].metrics.fBottom;
 }
 
-void GlyphRenderer::DrawRange(SkCanvas *canvas, SkPoint *positions, Attr attrs,
-                              size_t begin, size_t end, bool is_primary) {
-  auto style = AttrsToFontStyle(attrs);
-  auto &styled_font = m_styled_fonts[FontStyleToInt(style)];
+void GlyphRenderer::FindUnderline(FontStyle style, SkScalar *offset,
+                                  SkScalar *thickness) {
+  auto &metrics = m_styled_fonts[FontStyleToInt(style)].metrics;
+
+  *offset = 0;
+  *thickness = FindHeight() / 15.0;
+
+  if (metrics.fFlags & SkFontMetrics::kUnderlinePositionIsValid_Flag) {
+    *offset = metrics.fUnderlinePosition;
+  }
+
+  if (metrics.fFlags & SkFontMetrics::kUnderlineThicknessIsValid_Flag) {
+    *thickness = metrics.fUnderlineThickness;
+  }
+}
 
-  auto &font = styled_font.font;
-  auto &metrics = styled_font.metrics;
-  SkColor color = attrs.flags & Attr::kInverse ? attrs.background : attrs.foreground;
+void GlyphRenderer::DrawGlyph(SkCanvas *canvas, SkGlyphID glyph, FontStyle style,
+                              SkPoint pos) {
+  // A coverage mask has no room for subpixel antialiasing.
+  SkFont font = m_styled_fonts[FontStyleToInt(style)].font;
+  font.setEdging(SkFont::Edging::kAntiAlias);
 
   SkPaint paint;
   paint.setAntiAlias(true);
-  paint.setBlendMode(SkBlendMode::kSrc);
-  paint.setColor(color);
+  paint.setColor(SK_ColorBLACK);
 
   SkTextBlobBuilder builder;
-  const SkTextBlobBuilder::RunBuffer& run = builder.allocRunPos(font, end - begin);
-  std::copy(m_glyphs.data() + begin, m_glyphs.data() + end, run.glyphs);
-  // XXX: memcpy
-  memcpy(run.pos, positions + begin, (end - begin) * sizeof(positions[0]));
+  const SkTextBlobBuilder::RunBuffer& run = builder.allocRun(font, 1, pos.x(), pos.y());
+  run.glyphs[0] = glyph;
 
   canvas->drawTextBlob(builder.make(), 0, 0, paint);
+}
 
-  if (is_primary && attrs.flags & Attr::kUnderline) {
-    SkScalar last_y = positions[begin].y();
-    paint.setStyle(SkPaint::kStroke_Style);
-
-    SkScalar y_offset = 0;
-    SkScalar stroke_width = SkIntToScalar(FindHeight()) / 15.0;
-    auto &metrics = styled_font.metrics;
-
-    if (metrics.fFlags & SkFontMetrics::kUnderlinePositionIsValid_Flag) {
-      y_offset = metrics.fUnderlinePosition;
-    }
+sk_sp<SkTextBlob> GlyphRenderer::MakeBlob(FontStyle style, const SkGlyphID *glyphs,
+                                          absl::Span<const uint> cols, SkScalar width) {
+  SkTextBlobBuilder builder;
+  const SkTextBlobBuilder::RunBuffer& run = builder.allocRunPosH(
+      m_styled_fonts[FontStyleToInt(style)].font, cols.size(), 0);
+  for (size_t i = 0; i < cols.size(); i++) {
+    run.glyphs[i] = glyphs[cols[i]];
+    run.pos[i] = width * cols[i];
+  }
 
-    if (metrics.fFlags & SkFontMetrics::kUnderlineThicknessIsValid_Flag) {
-      stroke_width = metrics.fUnderlineThickness;
-    }
+  return builder.make();
+}
 
-    for (size_t i = begin; i < end; ) {
-      SkScalar begin_x = positions[i].x();
-      while (positions[i].y() == last_y && i < end) {
-        i++;
-      }
-      SkScalar end_x = positions[i - 1].x() + FindWidth();
+void GlyphRenderer::DrawBlob(SkCanvas *canvas, const sk_sp<SkTextBlob> &blob, Attr attrs,
+                             SkScalar baseline) {
+  SkPaint paint;
+  paint.setAntiAlias(true);
+  paint.setBlendMode(SkBlendMode::kSrc);
+  paint.setColor(attrs.flags & Attr::kInverse ? attrs.background : attrs.foreground);
 
-      SkPath path;
-      path.moveTo(begin_x, last_y + y_offset);
-      path.lineTo(end_x, last_y + y_offset);
+  canvas->drawTextBlob(blob, 0, baseline, paint);
+}
 
-      paint.setStrokeWidth(stroke_width);
-      canvas->drawPath(path, paint);
+void GlyphRenderer::DrawUnderline(SkCanvas *canvas, Attr attrs, SkScalar left,
+                                  SkScalar right, SkScalar baseline) {
+  SkScalar y_offset, stroke_width;
+  FindUnderline(AttrsToFontStyle(attrs), &y_offset, &stroke_width);
 
-      if (i < end) {
-        last_y = positions[i].y();
-        i++;
-      }
-    }
-  }
+  SkPaint paint;
+  paint.setAntiAlias(true);
+  paint.setBlendMode(SkBlendMode::kSrc);
+  paint.setColor(attrs.flags & Attr::kInverse ? attrs.background : attrs.foreground);
+  paint.setStyle(SkPaint::kStroke_Style);
+  paint.setStrokeWidth(stroke_width);
+
+  SkPath path;
+  path.moveTo(left, baseline + y_offset);
+  path.lineTo(right, baseline + y_offset);
+  canvas->drawPath(path, paint);
 }
 
 void GlyphRenderer::UpdateForFontChange() {
@@ -164,6 +183,7 @@ void GlyphRenderer::UpdateForFontChange() {
   for (auto &styled_font : m_styled_fonts) {
     SkFont &font = styled_font.font;
     auto &glyph_cache = styled_font.glyph_cache;
+    styled_font.unicode_cache.Clear();
 
     for (char c = 0; c < kCharMax; c++) {
       if (isprint(c)) {
@@ -177,44 +197,67 @@ void GlyphRenderer::UpdateForFontChange() {
   }
 }
 
-TextManager::TextManager() {}
+constexpr size_t GlyphCache::kMaxEntries;
+constexpr uint32 GlyphCache::kNone;
 
-void TextManager::Resize(int x, int y) {
-  m_rows = y;
-  m_cols = x;
+bool GlyphCache::Find(char32_t c, SkGlyphID *glyph) {
+  auto it = m_indexes.find(c);
+  if (it == m_indexes.end()) {
+    m_stats.misses++;
+    return false;
+  }
 
-  m_text.resize(m_rows * m_cols);
-  m_positions.resize(m_rows * m_cols);
-}
+  m_stats.hits++;
+  uint32 index = it->second;
+  if (index != m_head) {
+    Unlink(index);
+    PushFront(index);
+  }
 
-char32_t TextManager::cell(int x, int y) {
-  return m_text[y * m_cols + x];
+  *glyph = m_entries[index].glyph;
+  return true;
 }
 
-bool TextManager::set_cell(int x, int y, char32_t value) {
-  uint index = PosToOffset(x, y);
-  if (m_text[index] == value) {
-    return false;
+void GlyphCache::Insert(char32_t c, SkGlyphID glyph) {
+  uint32 index;
+  if (m_entries.size() < kMaxEntries) {
+    index = m_entries.size();
+    m_entries.push_back({c, glyph, kNone, kNone});
+  } else {
+    // Reuse the least recently used entry.
+    index = m_tail;
+    Unlink(index);
+    m_indexes.erase(m_entries[index].c);
+    m_entries[index].c = c;
+    m_entries[index].glyph = glyph;
+    m_stats.evictions++;
   }
 
-  m_text[index] = value;
-  return true;
+  m_indexes.emplace(c, index);
+  PushFront(index);
 }
 
-void TextManager::UpdatePositions(SkScalar height, SkScalar width) {
-  assert(m_text.size() == m_positions.size());
+void GlyphCache::Clear() {
+  m_entries.clear();
+  m_indexes.clear();
+  m_head = m_tail = kNone;
+}
 
-  for (int i=0; i<m_rows; i++) {
-    for (int j=0; j<m_cols; j++) {
-      SkPoint *point = &m_positions[i * m_cols + j];
-      point->fX = width * j;
-      point->fY = height * (i + 1);
-    }
-  }
+void GlyphCache::Unlink(uint32 index) {
+  Entry &entry = m_entries[index];
+  (entry.prev != kNone ? m_entries[entry.prev].next : m_head) = entry.next;
+  (entry.next != kNone ? m_entries[entry.next].prev : m_tail) = entry.prev;
+  entry.prev = entry.next = kNone;
 }
 
-void TextManager::DrawRangeWithRenderer(SkCanvas *canvas, GlyphRenderer *renderer,
-                                        Attr attrs, size_t begin, size_t end,
-                                        bool is_primary) {
-  renderer->DrawRange(canvas, m_positions.data(), attrs, begin, end, is_primary);
+void GlyphCache::PushFront(uint32 index) {
+  Entry &entry = m_entries[index];
+  entry.prev = kNone;
+  entry.next = m_head;
+  if (m_head != kNone) {
+    m_entries[m_head].prev = index;
+  } else {
+    m_tail = index;
+  }
+  m_head = index;
 }
@@ -2,37 +2,100 @@
 
 #include <SkCanvas.h>
 #include <SkFont.h>
+#include <SkTextBlob.h>
+#include <absl/types/span.h>
 
 #include <array>
 #include <limits>
+#include <vector>
 
 #include "base.h"
 #include "terminal.h"
 
+#define PHMAP_USE_ABSL_HASHEQ
+#include <parallel_hashmap/phmap.h>
+
 enum class FontStyle { kNormal, kBold, kItalic, kEnd };
 constexpr int FontStyleToInt(FontStyle style) { return static_cast<int>(style); }
 
 FontStyle AttrsToFontStyle(Attr attrs);
 
-// A GlyphRenderer knows little about its textual contents. Its sole goal is to store
-// glyphs in a horizontal array, and then render them using the given positions when
-// requested.
+struct GlyphCacheStats {
+  uint64 hits{0}, misses{0}, evictions{0};
+
+  GlyphCacheStats & operator+=(const GlyphCacheStats &rhs) {
+    hits += rhs.hits;
+    misses += rhs.misses;
+    evictions += rhs.evictions;
+    return *this;
+  }
+};
+
+// A GlyphCache maps codepoints to a font's glyphs for them (or 0, if it has none),
+// keeping only the most recently used kMaxEntries of them.
+class GlyphCache {
+public:
+  static constexpr size_t kMaxEntries = 4096;
+
+  // If c is in the cache, sets glyph to its glyph, marks it as the most recently used,
+  // and returns true.
+  bool Find(char32_t c, SkGlyphID *glyph);
+  // Adds c, which mustn't be in the cache already, dropping the least recently used entry
+  // if it's full.
+  void Insert(char32_t c, SkGlyphID glyph);
+  void Clear();
+
+  const GlyphCacheStats & stats() const { return m_stats; }
+private:
+  static constexpr uint32 kNone = std::numeric_limits<uint32>::max();
+
+  // The entries form a list from the most recently used (m_head) to the least (m_tail).
+  struct Entry {
+    char32_t c;
+    SkGlyphID glyph;
+    uint32 prev, next;
+  };
+
+  void Unlink(uint32 index);
+  void PushFront(uint32 index);
+
+  std::vector<Entry> m_entries;
+  phmap::flat_hash_map<char32_t, uint32> m_indexes;
+  uint32 m_head{kNone}, m_tail{kNone};
+  GlyphCacheStats m_stats;
+};
+
+// A GlyphRenderer knows little about its textual contents. It holds one font (in each
+// style), and draws whichever of the grid's glyphs it's handed.
 class GlyphRenderer {
 public:
   GlyphRenderer();
 
-  void Resize(int size);
   void SetTextSize(int height);
   void SetFont(string name);
-  bool UpdateGlyph(char32_t c, int index, FontStyle style);
-  void ClearGlyph(int index);
+  // Returns the glyph for c in the given style, or 0 if the font doesn't have one.
+  SkGlyphID FindGlyph(char32_t c, FontStyle style);
 
   SkScalar FindHeight();
   SkScalar FindWidth();
   SkScalar FindBaselineOffset();
-
-  void DrawRange(SkCanvas *canvas, SkPoint *positions, Attr attrs, size_t begin,
-                 size_t end, bool is_primary);
+  // Finds where the underline goes relative to the baseline, and how thick it is.
+  void FindUnderline(FontStyle style, SkScalar *offset, SkScalar *thickness);
+
+  // Draws the glyph alone at the given position, as a coverage mask.
+  void DrawGlyph(SkCanvas *canvas, SkGlyphID glyph, FontStyle style, SkPoint pos);
+
+  // The totals over every style's glyph cache.
+  GlyphCacheStats glyph_cache_stats();
+
+  // Makes a blob out of the glyphs of the given columns of a row, with its baseline at 0.
+  // The glyphs are indexed by column, and each column is width wide.
+  sk_sp<SkTextBlob> MakeBlob(FontStyle style, const SkGlyphID *glyphs,
+                             absl::Span<const uint> cols, SkScalar width);
+  void DrawBlob(SkCanvas *canvas, const sk_sp<SkTextBlob> &blob, Attr attrs,
+                SkScalar baseline);
+  void DrawUnderline(SkCanvas *canvas, Attr attrs, SkScalar left, SkScalar right,
+                     SkScalar baseline);
 private:
   void UpdateForFontChange();
 
@@ -44,36 +107,11 @@ private:
     SkFont font;
     SkFontMetrics metrics;
     std::array<SkGlyphID, kCharMax> glyph_cache;
+    // Everything that isn't printable ASCII.
+    GlyphCache unicode_cache;
   };
 
-  std::array<StyledFont, kStyleEnd> m_styled_fonts;
-
-  std::vector<SkGlyphID> m_glyphs;
-};
-
-// A TextManager is the bridge between a terminal's contents and a GlyphRenderer. It
-// contains the text itself, as well as the text positions. When drawn, it hands down the
-// positions to the GlyphRenderer. Note that a GlyphRenderer does not know when a
-// TextManager has updated its cells; the renderer only ever sees the positions.
-class TextManager {
-public:
-  TextManager();
-
-  int rows() { return m_rows; }
-  int cols() { return m_cols; }
-  char32_t cell(int x, int y);
-  bool set_cell(int x, int y, char32_t value);
-  void Resize(int x, int y);
-  void UpdatePositions(SkScalar height, SkScalar width);
+  SkGlyphID FindGlyph(StyledFont *styled_font, char32_t c);
 
-  uint PosToOffset(int x, int y) { return y * m_cols + x; }
-  uint PosToOffset(Pos pos) { return PosToOffset(pos.x, pos.y); }
-  Pos OffsetToPos(uint offset) { return {offset % m_cols, offset / m_cols}; }
-
-  void DrawRangeWithRenderer(SkCanvas *canvas, GlyphRenderer *renderer, Attr attrs,
-                             size_t begin, size_t end, bool is_primary);
-private:
-  uint m_cols{0}, m_rows{0};
-  std::u32string m_text;
-  std::vector<SkPoint> m_positions;
+  std::array<StyledFont, kStyleEnd> m_styled_fonts;
 };
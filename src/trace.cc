@@ -0,0 +1,117 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+Tracer gTracer;
+
+// Each buffer holds this many events at most, which is enough for a few minutes of
+// heavy use. Anything after that is counted and dropped.
+constexpr size_t kMaxEventsPerThread = 1 << 20;
+
+struct TraceEvent {
+  const char *name;
+  Tracer::clock::time_point begin, end;
+  const char *arg_name;
+  uint64 arg;
+};
+
+struct TraceBuffer {
+  int tid;
+  const char *name{nullptr};
+  std::vector<TraceEvent> events;
+  uint64 dropped{0};
+};
+
+static thread_local TraceBuffer *tls_buffer = nullptr;
+
+Tracer::Tracer(): m_start{clock::now()} {}
+Tracer::~Tracer() {}
+
+TraceBuffer * Tracer::CurrentBuffer() {
+  if (tls_buffer == nullptr) {
+    std::unique_lock<std::mutex> lock{m_lock};
+    m_buffers.emplace_back(new TraceBuffer);
+    tls_buffer = m_buffers.back().get();
+    tls_buffer->tid = m_buffers.size();
+  }
+
+  return tls_buffer;
+}
+
+void Tracer::SetThreadName(const char *name) {
+  if (m_enabled) {
+    CurrentBuffer()->name = name;
+  }
+}
+
+void Tracer::Record(const char *name, clock::time_point begin, const char *arg_name,
+                    uint64 arg) {
+  auto end = clock::now();
+  // Scopes often end right after a syscall, before its caller has looked at errno.
+  int saved_errno = errno;
+
+  TraceBuffer *buffer = CurrentBuffer();
+  if (buffer->events.size() == kMaxEventsPerThread) {
+    buffer->dropped++;
+  } else {
+    buffer->events.push_back({name, begin, end, arg_name, arg});
+  }
+
+  errno = saved_errno;
+}
+
+Error Tracer::Write(const string &path) {
+  FILE *file = fopen(path.c_str(), "we");
+  if (file == nullptr) {
+    return Error::Errno().Extend(fmt::format("opening {}", path));
+  }
+
+  auto micros = [&](clock::duration duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+  };
+
+  int pid = getpid();
+  bool first = true;
+  auto separator = [&]() {
+    const char *sep = first ? "\n" : ",\n";
+    first = false;
+    return sep;
+  };
+
+  fmt::print(file, "{{\"traceEvents\": [");
+
+  std::unique_lock<std::mutex> lock{m_lock};
+  for (auto &buffer : m_buffers) {
+    if (buffer->name != nullptr) {
+      fmt::print(file, "{}{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": {}, "
+                       "\"tid\": {}, \"args\": {{\"name\": \"{}\"}}}}",
+                 separator(), pid, buffer->tid, buffer->name);
+    }
+
+    for (auto &event : buffer->events) {
+      fmt::print(file, "{}{{\"name\": \"{}\", \"ph\": \"X\", \"pid\": {}, \"tid\": {}, "
+                       "\"ts\": {:.3f}, \"dur\": {:.3f}",
+                 separator(), event.name, pid, buffer->tid, micros(event.begin - m_start),
+                 micros(event.end - event.begin));
+      if (event.arg_name != nullptr) {
+        fmt::print(file, ", \"args\": {{\"{}\": {}}}", event.arg_name, event.arg);
+      }
+      fmt::print(file, "}}");
+    }
+
+    if (buffer->dropped != 0) {
+      fmt::print(stderr, "trace: dropped {} events from thread {}\n", buffer->dropped,
+                 buffer->name != nullptr ? buffer->name : "(unnamed)");
+    }
+  }
+
+  fmt::print(file, "\n]}}\n");
+
+  bool failed = ferror(file);
+  if (fclose(file) != 0 || failed) {
+    return Error::Errno().Extend(fmt::format("writing {}", path));
+  }
+  return Error::New();
+}
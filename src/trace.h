@@ -0,0 +1,82 @@
+#pragma once
+
+#include "base.h"
+#include "error.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Tracing support is only built in if UTERM_TRACING is defined (see the CMake option of
+// the same name). Otherwise, every TraceScope compiles down to nothing.
+#ifdef UTERM_TRACING
+constexpr bool kTracingBuilt = true;
+#else
+constexpr bool kTracingBuilt = false;
+#endif
+
+struct TraceBuffer;
+
+// The Tracer collects timed events from every thread, each into its own buffer, and
+// writes them out in Chrome's trace event format (which Perfetto can open too).
+class Tracer {
+public:
+  using clock = std::chrono::steady_clock;
+
+  Tracer();
+  ~Tracer();
+
+  bool enabled() const { return m_enabled; }
+  // Must be called before any threads that are to be traced are started.
+  void Enable() { m_enabled = true; }
+
+  // Names the calling thread in the trace.
+  void SetThreadName(const char *name);
+  // Adds an event to the calling thread's buffer. The names must be string literals.
+  void Record(const char *name, clock::time_point begin, const char *arg_name,
+              uint64 arg);
+  // Writes out everything recorded. Only safe once all the traced threads have stopped.
+  Error Write(const string &path);
+private:
+  TraceBuffer * CurrentBuffer();
+
+  bool m_enabled{false};
+  clock::time_point m_start;
+
+  std::mutex m_lock;
+  std::vector<std::unique_ptr<TraceBuffer>> m_buffers;
+};
+
+extern Tracer gTracer;
+
+// A TraceScope records an event covering its whole lifetime, if tracing is enabled.
+class TraceScope {
+public:
+  explicit TraceScope(const char *name) {
+    if (kTracingBuilt && gTracer.enabled()) {
+      m_name = name;
+      m_begin = Tracer::clock::now();
+    }
+  }
+
+  ~TraceScope() {
+    if (kTracingBuilt && m_name != nullptr) {
+      gTracer.Record(m_name, m_begin, m_arg_name, m_arg);
+    }
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope & operator=(const TraceScope&) = delete;
+
+  // Attaches a number to the event, e.g. how many bytes were processed.
+  void set_arg(const char *name, uint64 value) {
+    m_arg_name = name;
+    m_arg = value;
+  }
+private:
+  const char *m_name{nullptr};
+  Tracer::clock::time_point m_begin;
+  const char *m_arg_name{nullptr};
+  uint64 m_arg{0};
+};
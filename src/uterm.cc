@@ -1,23 +1,98 @@
 #include "uterm.h"
+#include "event_loop.h"
+#include "glfw_native.h"
+#include "trace.h"
 
+#include <algorithm>
+
+#include <sys/epoll.h>
 #include <sys/wait.h>
 #include <signal.h>
 
 Uterm gUterm;
 
-void ProtectedBuffer::Append(string text) {
-  std::unique_lock<std::mutex> lock{m_lock};
-  m_buffer += text;
+// Reads up to max bytes of pty output straight into the ring's free space, wrapping
+// around its end if needed.
+static Error ReadIntoRing(Pty *pty, ByteRing *ring, size_t max, size_t *nread,
+                          bool *eof) {
+  TraceScope trace{"ReadIntoRing"};
+
+  absl::Span<char> spans[2];
+  ring->WritableSpans(&spans[0], &spans[1]);
+
+  iovec iov[2];
+  int iovcnt = 0;
+  for (auto &span : spans) {
+    if (max == 0 || span.empty()) {
+      break;
+    }
+
+    iov[iovcnt].iov_base = span.data();
+    iov[iovcnt].iov_len = std::min(max, span.size());
+    max -= iov[iovcnt].iov_len;
+    iovcnt++;
+  }
+
+  *nread = 0;
+  if (iovcnt == 0) {
+    return Error::New();
+  }
+
+  auto err = pty->Read(iov, iovcnt, nread, eof);
+  ring->Commit(*nread);
+  trace.set_arg("bytes", *nread);
+  return err;
 }
 
-string ProtectedBuffer::ReadAndClear() {
-  std::unique_lock<std::mutex> lock{m_lock};
-  string result = m_buffer;
-  m_buffer.clear();
-  return result;
+// Feeds everything that's currently in the ring to the terminal.
+static void DrainRing(ByteRing *ring, Terminal *term) {
+  TraceScope trace{"DrainRing"};
+
+  while (ring->size() != 0) {
+    auto span = ring->ReadableSpan();
+    term->WriteToScreen(absl::string_view{span.data(), span.size()});
+    ring->Consume(span.size());
+  }
+}
+
+static void FlushPty(Pty *pty, bool *backed_up = nullptr) {
+  if (auto err = pty->Flush(backed_up)) {
+    err.Extend("writing to pty").Print();
+  }
+}
+
+constexpr std::chrono::milliseconds FloodDetector::kWindow;
+
+bool FloodDetector::Update(uint64 total_bytes) {
+  if (m_threshold == 0) {
+    return false;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_window_start);
+  uint64 bytes = total_bytes - m_window_bytes;
+  // If nothing checked in for a while, the window is stretched to match, so a burst after
+  // a long pause isn't mistaken for a flood.
+  uint64 limit = m_threshold * std::max(elapsed, kWindow).count() / 1000;
+
+  if (bytes > limit) {
+    m_flooding = true;
+  } else if (elapsed >= kWindow) {
+    m_flooding = false;
+  }
+
+  if (elapsed >= kWindow) {
+    m_window_start = now;
+    m_window_bytes = total_bytes;
+  }
+
+  return m_flooding;
 }
 
-ReaderThread::ReaderThread(Pty *pty): m_thread{&ReaderThread::StaticRun, this, pty} {}
+ReaderThread::ReaderThread(Pty *pty, Terminal *term, LatencyTracker *latency,
+                           size_t ring_capacity, size_t read_size):
+  m_latency{latency}, m_ring{ring_capacity}, m_read_size{read_size},
+  m_thread{&ReaderThread::StaticRun, this, pty, term} {}
 ReaderThread::~ReaderThread() { Stop(); }
 
 void ReaderThread::Interrupt() {
@@ -33,20 +108,58 @@ void ReaderThread::Stop() {
   m_thread.join();
 }
 
-void ReaderThread::StaticRun(Pty *pty) {
-  bool eof = false;
+void ReaderThread::StaticRun(Pty *pty, Terminal *term) {
+  gTracer.SetThreadName("reader");
+
+  // Any read at least this big is assumed to be bulk output rather than an interactive
+  // echo.
+  constexpr size_t kBulkReadSize = 1024;
+
+  bool eof = false, bulk = false;
   while (!m_done_flag.get()) {
-    if (auto e_text = pty->Read(&eof)) {
-      if (!e_text->empty()) {
-        m_buffer.Append(*e_text);
-        // Do a short (0.5ms) sleep to avoid high CPU usage because of short polls.
-        usleep(500);
-      } else if (eof) {
-        m_done_flag.set();
+    // Small reads are committed as soon as they arrive, and then we go right back to
+    // blocking. Bulk output is instead drained greedily: keep reading for as long as
+    // there's something to read, and only block again once the pty is empty.
+    if (!bulk) {
+      bool readable = false, interrupted = false;
+
+      TraceScope trace{"Pty::Poll"};
+      auto wait_start = std::chrono::steady_clock::now();
+      auto err = pty->Poll(-1, &readable, &interrupted);
+      m_stats.waiting += std::chrono::steady_clock::now() - wait_start;
+
+      if (err) {
+        err.Extend("waiting for data from pty").Print();
+        continue;
+      } else if (!readable) {
+        // Either the pty only became writable (and Poll already flushed to it), or a
+        // signal interrupted us. Only a signal, i.e. SIGCHLD, can mean the child is gone.
+        if (interrupted && pty->ChildExited()) {
+          m_done_flag.set();
+        }
+        continue;
       }
-    } else {
-      e_text.Error().Extend("reading data from pty").Print();
     }
+
+    size_t nread = 0;
+    if (auto err = ReadIntoRing(pty, &m_ring, m_read_size, &nread, &eof)) {
+      err.Extend("reading data from pty").Print();
+    } else if (eof) {
+      m_done_flag.set();
+    } else if (nread != 0) {
+      m_stats.reads++;
+      m_stats.bytes += nread;
+
+      // Parse it right here, so the render thread only ever has to draw the result.
+      DrainRing(&m_ring, term);
+      if (m_latency != nullptr) {
+        m_latency->OutputParsed();
+      }
+      // Send back any replies the terminal had to what it just parsed.
+      FlushPty(pty);
+    }
+
+    bulk = nread >= kBulkReadSize;
   }
 }
 
@@ -64,25 +177,61 @@ int Uterm::Run() {
 
   constexpr int kWidth = 800, kHeight = 600;
 
-  signal(SIGCHLD, CatchSigchld);
-  signal(SIGUSR1, [](int sig) {});
+  if (m_config.latency_hud() || !m_config.latency_dump().empty()) {
+    m_latency.reset(new LatencyTracker);
+  }
+
+  if (!m_config.latency_dump().empty()) {
+    if (auto err = m_latency->OpenDump(m_config.latency_dump())) {
+      err.Extend("while opening latency dump").Print();
+    }
+  }
+
+  if (!m_config.event_loop()) {
+    signal(SIGCHLD, CatchSigchld);
+    signal(SIGUSR1, [](int sig) {});
+  }
 
   Pty pty;
+  if (!m_record_path.empty()) {
+    if (auto err = m_recorder.Open(m_record_path)) {
+      err.Extend("while opening recording").Print();
+      return 1;
+    }
+    pty.set_recorder(&m_recorder);
+  }
+
   if (auto err = pty.Spawn({m_config.shell(), "-i"})) {
     err.Extend("while initializing pty").Print();
     return 1;
   }
 
-  ReaderThread reader{&pty};
-  m_current_reader = &reader;
+  int child_fd = -1;
+  if (m_config.event_loop()) {
+    // This has to happen before the window is created, since the GL driver may start
+    // threads of its own (see OpenChildExitFd).
+    auto e_child_fd = OpenChildExitFd(pty.pid());
+    if (auto err = e_child_fd.Error()) {
+      err.Extend("while watching for child exit").Print();
+      return 1;
+    }
+    child_fd = *e_child_fd;
+  }
 
-  if (auto err = m_window.Initialize(kWidth, kHeight, m_config.hwaccel(), m_config.vsync(),
+  if (auto err = m_window.Initialize(kWidth, kHeight, m_config.hwaccel(),
+                                     m_config.gpu_atlas(), m_config.vsync(),
                                      m_config.theme())) {
     err.Extend("while initializing window").Print();
     return 1;
   }
 
   m_term.set_theme(m_config.theme());
+  m_term.set_scrollback_lines(m_config.scrollback_lines());
+  if (m_config.scrollback_lines() != 0 && !m_config.scrollback_dir().empty()) {
+    if (auto err = m_term.SpillScrollback(m_config.scrollback_dir())) {
+      err.Extend("while setting up scrollback; keeping it all in memory").Print();
+    }
+  }
 
   m_term.set_pty(&pty);
   m_term.set_copy_cb(std::bind(&Uterm::HandleCopy, this, _1));
@@ -103,13 +252,45 @@ int Uterm::Run() {
   m_window.set_selection_cb(std::bind(&Uterm::HandleSelection, this, _1, _2, _3));
   m_window.set_scroll_cb(std::bind(&Uterm::HandleScroll, this, _1, _2));
 
+  int ret;
+  if (m_config.event_loop()) {
+    ret = RunEventLoop(&pty, child_fd);
+    close(child_fd);
+  } else {
+    ret = RunThreaded(&pty);
+  }
+
+  if (auto err = m_recorder.Close()) {
+    err.Extend("while saving recording").Print();
+  }
+
+  if (m_latency != nullptr) {
+    if (auto err = m_latency->CloseDump()) {
+      err.Extend("while saving latencies").Print();
+    }
+  }
+
+  return ret;
+}
+
+int Uterm::RunThreaded(Pty *pty) {
+  ReaderThread reader{pty, &m_term, m_latency.get(),
+                      static_cast<size_t>(m_config.ring_buffer_size()),
+                      static_cast<size_t>(m_config.read_size())};
+  {
+    std::unique_lock<std::mutex> lock{m_current_reader_lock};
+    m_current_reader = &reader;
+  }
+
   double mark = 0;
   double fps = m_config.fps();
   int frames_current_second = 0;
 
-  while (m_window.isopen() && !reader.done()) {
-    SkCanvas *canvas = m_window.canvas();
+  FloodDetector flood{static_cast<uint64>(m_config.flood_threshold())};
+  double flood_interval = 1.0 / m_config.flood_fps();
+  double last_frame = 0;
 
+  while (m_window.isopen() && !reader.done()) {
     double current = glfwGetTime();
     if (current - 1 >= mark) {
       frames_current_second = 0;
@@ -123,28 +304,241 @@ int Uterm::Run() {
       double actual_position = frames_current_second / fps;
 
       if (actual_position > expected_position) {
+        TraceScope trace{"FrameLimiter::Sleep"};
         usleep((actual_position - expected_position) * 1000000);
       }
     }
 
-    string buffer = reader.buffer().ReadAndClear();
-    if (!buffer.empty()) {
-      m_term.WriteToScreen(buffer);
+    // While flooded, most frames are skipped so the reader thread doesn't have to keep
+    // stopping to publish snapshots. The window still gets checked every time, though.
+    if (!flood.Update(m_term.bytes_written()) || current - last_frame >= flood_interval) {
+      last_frame = current;
+      DrawFrame();
+    }
+    m_window.Poll();
+
+    // Send everything typed this frame in one go. If the child couldn't take all of it
+    // (e.g. during a big paste), wake up the reader so it starts waiting for the pty to
+    // be writable too. That's only needed once: from then on, the reader keeps waiting
+    // for it until the queue is empty.
+    bool backed_up = false;
+    FlushPty(pty, &backed_up);
+    if (backed_up) {
+      reader.Interrupt();
     }
-
-    m_term.Draw();
-
-    bool significant_redraw = m_display.Draw(canvas, !m_config.hwaccel());
-    m_window.DrawAndPoll(significant_redraw);
   }
 
   std::unique_lock<std::mutex> lock{m_current_reader_lock};
   m_current_reader = nullptr;
   reader.Stop();
 
+  if (m_config.print_stats()) {
+    PrintStats(reader.ring(), reader.stats());
+  }
+
   return 0;
 }
 
+// Converts the duration to a poll timeout, rounding up to the next millisecond.
+template <typename Duration>
+static int DurationToTimeout(Duration duration) {
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+  return (us + 999) / 1000;
+}
+
+int Uterm::RunEventLoop(Pty *pty, int child_fd) {
+  using clock = std::chrono::steady_clock;
+
+  EventLoop loop;
+  if (auto err = loop.Initialize()) {
+    err.Extend("while initializing event loop").Print();
+    return 1;
+  }
+
+  ByteRing ring{static_cast<size_t>(m_config.ring_buffer_size())};
+  ReaderStats stats;
+  bool done = false;
+
+  auto frame_interval = std::chrono::microseconds{1000000 / m_config.fps()};
+  auto flood_interval = std::chrono::microseconds{1000000 / m_config.flood_fps()};
+  FloodDetector flood{static_cast<uint64>(m_config.flood_threshold())};
+
+  auto err = loop.Add(pty->fd(), EPOLLIN, [&](uint32 events) {
+    if (events & EPOLLOUT) {
+      FlushPty(pty);
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+      return;
+    }
+
+    // Drain everything that's available right now, parsing as we go so the ring never
+    // fills up. Stop after a frame's worth of time so a flood can't starve the window.
+    auto deadline = clock::now() + frame_interval;
+    while (clock::now() < deadline) {
+      size_t nread = 0;
+      bool eof = false;
+
+      if (auto err = ReadIntoRing(pty, &ring, m_config.read_size(), &nread, &eof)) {
+        err.Extend("reading data from pty").Print();
+        break;
+      } else if (eof) {
+        done = true;
+        break;
+      } else if (nread == 0) {
+        break;
+      }
+
+      stats.reads++;
+      stats.bytes += nread;
+
+      DrainRing(&ring, &m_term);
+      if (m_latency != nullptr) {
+        m_latency->OutputParsed();
+      }
+    }
+  });
+  if (err) {
+    err.Extend("while watching pty").Print();
+    return 1;
+  }
+
+  if (auto err = loop.Add(child_fd, EPOLLIN, [&](uint32 events) {
+    DrainChildExitFd(child_fd);
+    done = pty->ChildExited();
+  })) {
+    err.Extend("while watching for child exit").Print();
+    return 1;
+  }
+
+  // If we know the window system's fd, then window events will wake us up like anything
+  // else. Otherwise (e.g. on Wayland), we have to fall back to checking for them once
+  // every frame, which means waking up that often even when idle.
+  int display_fd = GlfwConnectionFd();
+  if (display_fd != -1) {
+    if (auto err = loop.Add(display_fd, EPOLLIN, [](uint32 events) {})) {
+      err.Extend("while watching window events").Print();
+      return 1;
+    }
+  }
+
+  auto last_frame = clock::time_point{};
+  bool pending_frame = true;
+  bool watching_writable = false;
+
+  // Key presses and the like only queue up what they write to the pty, and may change
+  // what's on the screen, so every time the window is checked, the writes are sent and a
+  // frame is drawn if anything happened.
+  auto poll_window = [&]() {
+    if (m_window.Poll()) {
+      pending_frame = true;
+    }
+
+    // If the child couldn't take all of it, have the loop tell us once it can take more.
+    FlushPty(pty);
+    bool want_writable = pty->has_pending_writes();
+    if (want_writable != watching_writable) {
+      uint32 events = want_writable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+      if (auto err = loop.Modify(pty->fd(), events)) {
+        return err.Extend("while watching pty");
+      }
+      watching_writable = want_writable;
+    }
+
+    return Error::New();
+  };
+
+  while (m_window.isopen() && !done) {
+    int timeout = -1;
+
+    if (pending_frame) {
+      // While flooded, only draw every so often and spend the rest of the time parsing.
+      // Once the flood stops, the next frame shows where it ended up.
+      auto interval = flood.Update(m_term.bytes_written()) ? flood_interval
+                                                            : frame_interval;
+      auto since_last_frame = clock::now() - last_frame;
+      if (since_last_frame >= interval) {
+        last_frame = clock::now();
+        DrawFrame();
+        pending_frame = false;
+
+        // Drawing may have read window events off the connection (e.g. while swapping
+        // buffers), in which case its fd won't wake us up for them.
+        if (auto err = poll_window()) {
+          err.Print();
+          return 1;
+        }
+      } else {
+        // Too soon after the last one; come back once the next frame is due.
+        auto remaining = interval - since_last_frame;
+        timeout = DurationToTimeout(remaining);
+      }
+    }
+
+    // A search in progress also only moves along as frames are drawn, and output held
+    // back by a synchronized update needs a frame to show up once it times out.
+    if (!pending_frame && (display_fd == -1 || m_term.search_pending() ||
+                           m_term.sync_pending())) {
+      timeout = DurationToTimeout(frame_interval);
+    }
+
+    auto wait_start = clock::now();
+    if (auto err = loop.Poll(timeout)) {
+      err.Extend("while polling for events").Print();
+      return 1;
+    }
+    stats.waiting += clock::now() - wait_start;
+
+    // Whatever woke us up probably changed something, and if it was the timeout then the
+    // window needs to be checked again anyway.
+    pending_frame = true;
+    if (auto err = poll_window()) {
+      err.Print();
+      return 1;
+    }
+  }
+
+  if (m_config.print_stats()) {
+    PrintStats(ring, stats);
+  }
+
+  return 0;
+}
+
+void Uterm::DrawFrame() {
+  TraceScope trace{"Uterm::DrawFrame"};
+
+  if (m_latency != nullptr) {
+    m_latency->FrameStarted();
+  }
+
+  m_term.Draw();
+
+  bool significant_redraw;
+  if (AtlasRenderer *atlas = m_window.atlas()) {
+    significant_redraw = m_display.DrawToAtlas(atlas);
+  } else {
+    SkCanvas *canvas = m_window.canvas();
+    SkRect hud_bounds;
+    if (m_config.latency_hud()) {
+      // The overlay hides whatever's under it, so those cells need drawing again each
+      // time for it to go on top of.
+      hud_bounds = m_latency->HudBounds(canvas->getBaseLayerSize().width());
+      m_display.Invalidate(hud_bounds);
+    }
+
+    significant_redraw = m_display.Draw(canvas, !m_config.hwaccel());
+    if (m_config.latency_hud()) {
+      m_latency->DrawHud(canvas, hud_bounds);
+      significant_redraw = true;
+    }
+  }
+
+  m_window.Draw(significant_redraw);
+  if (m_latency != nullptr) {
+    m_latency->FramePresented();
+  }
+}
+
 void Uterm::InterruptReader() {
   std::unique_lock<std::mutex> lock{m_current_reader_lock};
 
@@ -153,6 +547,45 @@ void Uterm::InterruptReader() {
   }
 }
 
+void Uterm::PrintStats(const ByteRing &ring, const ReaderStats &stats) {
+  using seconds = std::chrono::duration<double>;
+
+  fmt::print("reader ring: {} of {} bytes used at peak\n", ring.high_water(),
+             ring.capacity());
+
+  double elapsed = seconds(std::chrono::steady_clock::now() - stats.start).count();
+  double waiting = seconds(stats.waiting).count();
+  fmt::print("reader: {} reads ({:.1f}/s), {:.1f} bytes/read, {:.3f}s of {:.3f}s waiting\n",
+             stats.reads, stats.reads / elapsed,
+             stats.reads ? static_cast<double>(stats.bytes) / stats.reads : 0.0,
+             waiting, elapsed);
+
+  auto damage = m_term.damage_stats();
+  if (damage.snapshots != 0) {
+    fmt::print("damage: {} snapshots, {:.1f} rows changed and {:.1f} rows scrolled per "
+               "snapshot\n", damage.snapshots,
+               static_cast<double>(damage.rows_changed) / damage.snapshots,
+               static_cast<double>(damage.rows_scrolled) / damage.snapshots);
+  }
+
+  auto attrs = m_term.attr_cache_stats();
+  if (attrs.lookups != 0) {
+    fmt::print("attribute cache: {} lookups, {:.1f}% hits\n", attrs.lookups,
+               100.0 * attrs.hits / attrs.lookups);
+  }
+
+  auto glyphs = m_display.glyph_cache_stats();
+  if (glyphs.hits + glyphs.misses != 0) {
+    fmt::print("glyph cache: {} lookups, {:.1f}% hits, {} evictions\n",
+               glyphs.hits + glyphs.misses,
+               100.0 * glyphs.hits / (glyphs.hits + glyphs.misses), glyphs.evictions);
+  }
+
+  auto scrollback = m_term.scrollback_stats();
+  fmt::print("scrollback: {} lines in {} KiB, plus {} KiB spilled to disk\n",
+             scrollback.lines, scrollback.bytes >> 10, scrollback.spilled_bytes >> 10);
+}
+
 void Uterm::HandleCopy(const string &str) {
   m_window.ClipboardWrite(str);
 }
@@ -162,11 +595,21 @@ string Uterm::HandlePaste() {
 }
 
 void Uterm::HandleKey(uint32 keysym, int mods) {
-  m_term.WriteKeysymToPty(keysym, mods);
+  auto pressed = LatencyTracker::clock::now();
+  // Only keys that reach the child get an echo to time; copying, pasting and scrolling
+  // are handled here and would never be matched up with any output.
+  bool sent = false;
+  m_term.WriteKeysymToPty(keysym, mods, &sent);
+  if (sent && m_latency != nullptr) {
+    m_latency->KeyPressed(pressed);
+  }
 }
 
 void Uterm::HandleChar(uint code) {
-  m_term.WriteUnicodeToPty(code);
+  auto pressed = LatencyTracker::clock::now();
+  if (m_term.WriteUnicodeToPty(code) && m_latency != nullptr) {
+    m_latency->KeyPressed(pressed);
+  }
 }
 
 void Uterm::HandleResize(int width, int height) {
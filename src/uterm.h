@@ -4,8 +4,12 @@
 #include "terminal.h"
 #include "display.h"
 #include "config.h"
+#include "latency.h"
+#include "recorder.h"
+#include "ring_buffer.h"
 
 #include <atomic>
+#include <chrono>
 #include <thread>
 #include <mutex>
 
@@ -17,35 +21,66 @@ private:
   std::atomic<bool> m_flag{false};
 };
 
-class ProtectedBuffer {
+struct ReaderStats {
+  std::chrono::steady_clock::time_point start{std::chrono::steady_clock::now()};
+  uint64 reads{0}, bytes{0};
+  // Time spent blocked waiting for the pty to become readable.
+  std::chrono::nanoseconds waiting{0};
+};
+
+// A FloodDetector notices when output is coming in faster than anyone could read it
+// (e.g. cat'ing a huge file), so the caller can stop drawing every frame and spend the
+// time parsing instead.
+class FloodDetector {
 public:
-  void Append(string text);
-  string ReadAndClear();
+  // threshold is in bytes per second; 0 never detects a flood.
+  FloodDetector(uint64 threshold): m_threshold{threshold} {}
+
+  bool flooding() const { return m_flooding; }
+  // Takes the total number of bytes written to the terminal so far, and returns whether
+  // it's currently being flooded.
+  bool Update(uint64 total_bytes);
 private:
-  std::mutex m_lock;
-  string m_buffer;
+  // How long the rate is measured over. A flood starts as soon as the threshold is passed
+  // within one window, but only ends after a whole window below it.
+  static constexpr std::chrono::milliseconds kWindow{100};
+
+  uint64 m_threshold;
+  std::chrono::steady_clock::time_point m_window_start{std::chrono::steady_clock::now()};
+  uint64 m_window_bytes{0};
+  bool m_flooding{false};
 };
 
 class ReaderThread {
 public:
-  ReaderThread(Pty *pty);
+  // latency may be null.
+  ReaderThread(Pty *pty, Terminal *term, LatencyTracker *latency, size_t ring_capacity,
+               size_t read_size);
   ~ReaderThread();
 
   void Interrupt();
   void Stop();
 
-  ProtectedBuffer & buffer() { return m_buffer; }
+  ByteRing & ring() { return m_ring; }
+  // Only safe to look at once the thread has been stopped.
+  const ReaderStats & stats() { return m_stats; }
   bool done() { return m_done_flag.get(); }
 private:
-  void StaticRun(Pty *pty);
+  void StaticRun(Pty *pty, Terminal *term);
 
-  std::thread m_thread;
-  ProtectedBuffer m_buffer;
+  LatencyTracker *m_latency;
+  ByteRing m_ring;
+  size_t m_read_size;
+  ReaderStats m_stats;
   AtomicFlag m_done_flag;
+  std::thread m_thread;
 };
 
 class Uterm {
 public:
+  // If set, the session is recorded to the given file (see Recorder).
+  void set_record_path(const string &path) { m_record_path = path; }
+
   int Run();
   void InterruptReader();
 private:
@@ -57,11 +92,19 @@ private:
   void HandleSelection(Selection state, double mx, double my);
   void HandleScroll(ScrollDirection direction, uint distance);
   void HandleTitle(const string &title);
+  int RunThreaded(Pty *pty);
+  int RunEventLoop(Pty *pty, int child_fd);
+  void DrawFrame();
+  void PrintStats(const ByteRing &ring, const ReaderStats &stats);
 
   std::mutex m_current_reader_lock;
   ReaderThread *m_current_reader{nullptr};
 
   Config m_config;
+  string m_record_path;
+  Recorder m_recorder;
+  // Only set if latency tracking is turned on.
+  std::unique_ptr<LatencyTracker> m_latency;
   Terminal m_term;
   Display m_display{&m_term};
   Window m_window;
@@ -1,6 +1,7 @@
 #include "window.h"
 #include "terminal.h"
 #include "keys.h"
+#include "trace.h"
 
 #include <gl/GrGLInterface.h>
 #include <gl/GrGLUtil.h>
@@ -17,6 +18,7 @@ Window::~Window() {
   m_context.reset();
   m_interface.reset();
   m_gl.reset();
+  m_atlas.reset();
 
   glfwSetCursor(m_window, nullptr);
   glfwDestroyCursor(m_cursor);
@@ -34,8 +36,9 @@ bool Window::isopen() {
   return !glfwWindowShouldClose(m_window);
 }
 
-Error Window::Initialize(int width, int height, bool hwaccel, int vsync, const Theme& theme) {
-  m_hwaccel = hwaccel;
+Error Window::Initialize(int width, int height, bool hwaccel, bool gpu_atlas, int vsync,
+                         const Theme& theme) {
+  m_hwaccel = hwaccel && !gpu_atlas;
   m_theme = &theme;
 
   glfwSetErrorCallback([](int ec, const char *err) {
@@ -82,7 +85,14 @@ Error Window::Initialize(int width, int height, bool hwaccel, int vsync, const T
 
   glfwGetFramebufferSize(m_window, &m_fb_width, &m_fb_height);
 
-  if (m_hwaccel) {
+  if (gpu_atlas) {
+    m_atlas = absl::make_unique<AtlasRenderer>();
+    if (auto err = m_atlas->Initialize()) {
+      return err.Extend("while initializing atlas renderer");
+    }
+    m_atlas->Resize(m_fb_width, m_fb_height);
+    return Error::New();
+  } else if (m_hwaccel) {
     glViewport(0, 0, m_fb_width, m_fb_height);
     glClearColor(1, 1, 1, 0);
     glClearStencil(0);
@@ -124,8 +134,18 @@ void Window::SetTitle(const string &title) {
   glfwSetWindowTitle(m_window, title.c_str());
 }
 
-void Window::DrawAndPoll(bool significant_redraw) {
+void Window::Draw(bool significant_redraw) {
+  if (m_atlas != nullptr) {
+    m_atlas->Draw((*m_theme)[Colors::kBackground]);
+
+    TraceScope trace{"Window::Swap"};
+    glfwSwapBuffers(m_window);
+    return;
+  }
+
   if (significant_redraw && !m_hwaccel) {
+    TraceScope trace{"Window::Upload"};
+
     SkPixmap pixmap;
     canvas()->flush();
     canvas()->peekPixels(&pixmap);
@@ -133,31 +153,50 @@ void Window::DrawAndPoll(bool significant_redraw) {
     m_gl->UpdateTextureData(pixmap.addr());
   }
 
-  if (m_hwaccel)
-    canvas()->flush();
-  else
-    m_gl->Draw();
-  glfwSwapBuffers(m_window);
+  {
+    TraceScope trace{"Window::Flush"};
+    if (m_hwaccel)
+      canvas()->flush();
+    else
+      m_gl->Draw();
+  }
+
+  {
+    TraceScope trace{"Window::Swap"};
+    glfwSwapBuffers(m_window);
+  }
 
   if (m_hwaccel)
     // Lazy-updating is not used when hardware-accelerated, so always clear the canvas.
     canvas()->clear((*m_theme)[Colors::kBackground]);
+}
 
+bool Window::Poll() {
   bool previous_selection_status = m_selection_active;
+  m_had_events = false;
   glfwPollEvents();
 
   double mx, my;
   glfwGetCursorPos(m_window, &mx, &my);
 
   if (m_selection_active) {
-    if (previous_selection_status) {
-      m_selection_cb(Selection::kUpdate, mx, my);
-    } else {
+    if (!previous_selection_status) {
       m_selection_cb(Selection::kBegin, mx, my);
+      m_had_events = true;
+    } else if (mx != m_selection_x || my != m_selection_y) {
+      // Holding the button down without moving doesn't count, or else the caller would
+      // keep drawing frames for nothing.
+      m_selection_cb(Selection::kUpdate, mx, my);
+      m_had_events = true;
     }
   } else if (previous_selection_status) {
     m_selection_cb(Selection::kEnd, mx, my);
+    m_had_events = true;
   }
+
+  m_selection_x = mx;
+  m_selection_y = my;
+  return m_had_events;
 }
 
 Error Window::CreateSurface() {
@@ -193,6 +232,7 @@ Error Window::CreateSurface() {
 void Window::StaticKeyCallback(GLFWwindow *glfw_window, int key, int scancode,
                                int action, int glfw_mods){
   Window *window = static_cast<Window*>(glfwGetWindowUserPointer(glfw_window));
+  window->m_had_events = true;
 
   if (action != GLFW_PRESS && action != GLFW_REPEAT) return;
 
@@ -208,11 +248,13 @@ void Window::StaticKeyCallback(GLFWwindow *glfw_window, int key, int scancode,
 
 void Window::StaticCharCallback(GLFWwindow *glfw_window, uint code) {
   Window *window = static_cast<Window*>(glfwGetWindowUserPointer(glfw_window));
+  window->m_had_events = true;
   window->m_char_cb(code);
 }
 
 void Window::StaticWinResizeCallback(GLFWwindow *glfw_window, int width, int height) {
   Window *window = static_cast<Window*>(glfwGetWindowUserPointer(glfw_window));
+  window->m_had_events = true;
   window->m_resize_cb(width, height);
 }
 
@@ -222,10 +264,16 @@ void Window::StaticFbResizeCallback(GLFWwindow *glfw_window, int width, int heig
   }
 
   Window *window = static_cast<Window*>(glfwGetWindowUserPointer(glfw_window));
+  window->m_had_events = true;
 
   window->m_fb_width = width;
   window->m_fb_height = height;
 
+  if (window->m_atlas != nullptr) {
+    window->m_atlas->Resize(width, height);
+    return;
+  }
+
   if (window->m_hwaccel)
     glViewport(0, 0, width, height);
   else
@@ -240,6 +288,7 @@ void Window::StaticMouseCallback(GLFWwindow *glfw_window, int button, int action
                                  int mods) {
   if (button != GLFW_MOUSE_BUTTON_LEFT) return;
   Window *window = static_cast<Window*>(glfwGetWindowUserPointer(glfw_window));
+  window->m_had_events = true;
 
   if (action == GLFW_PRESS) {
     window->m_selection_active = true;
@@ -251,6 +300,7 @@ void Window::StaticMouseCallback(GLFWwindow *glfw_window, int button, int action
 void Window::StaticScrollCallback(GLFWwindow *glfw_window, double xoffset,
                                   double yoffset) {
   Window *window = static_cast<Window*>(glfwGetWindowUserPointer(glfw_window));
+  window->m_had_events = true;
   if (yoffset > 0) {
     window->m_scroll_cb(ScrollDirection::kUp, yoffset);
   } else if (yoffset < 0) {
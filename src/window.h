@@ -2,6 +2,7 @@
 
 #include "base.h"
 #include "error.h"
+#include "atlas_renderer.h"
 #include "attrs.h"
 #include "gl_manager.h"
 
@@ -31,15 +32,23 @@ public:
   void set_selection_cb(SelectionCb selection_cb);
   void set_scroll_cb(ScrollCb scroll_cb);
 
-  Error Initialize(int width, int height, bool hwaccel, int vsync, const Theme& theme);
+  // If gpu_atlas is set, everything is drawn with the atlas renderer, and hwaccel is
+  // ignored.
+  Error Initialize(int width, int height, bool hwaccel, bool gpu_atlas, int vsync,
+                   const Theme& theme);
   bool isopen();
+  // There's no canvas when drawing with the atlas renderer.
   SkCanvas * canvas() { return m_surface->getCanvas(); }
+  AtlasRenderer * atlas() { return m_atlas.get(); }
 
   string ClipboardRead();
   void ClipboardWrite(const string &str);
   void SetTitle(const string &str);
 
-  void DrawAndPoll(bool significant_redraw);
+  // Puts the canvas on the screen.
+  void Draw(bool significant_redraw);
+  // Processes pending window events, and returns whether there were any.
+  bool Poll();
 private:
   bool m_hwaccel{true};
   const Theme *m_theme{nullptr};
@@ -66,8 +75,12 @@ private:
   GLFWcursor *m_cursor{nullptr};
   int m_fb_width, m_fb_height;
   bool m_selection_active{false};
+  double m_selection_x{0}, m_selection_y{0};
+  // Set by every callback, so Poll can tell whether anything happened.
+  bool m_had_events{false};
 
   std::unique_ptr<GLManager> m_gl{new GLManager};
+  std::unique_ptr<AtlasRenderer> m_atlas;
   GrGLFramebufferInfo m_info;
   sk_sp<const GrGLInterface> m_interface;
   sk_sp<GrContext> m_context;